@@ -7,6 +7,7 @@
  */
 #include "vhdlib.h"
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <byteswap.h>
 
@@ -17,10 +18,24 @@ void usage()
 	       "show vhdfile footer info");
 	printf("\n\tor: vhd -d [vhdfile] -w[LBA] -b [binfile]\t"
 	       "write bin into specified LBA");
+	printf("\n\tor: vhd -d [vhdfile] -j -w[LBA] -b [binfile] ...\t"
+	       "write bins as one atomic batch");
+	printf("\n\tor: vhd -d [vhdfile] -t [start-end]\t\t"
+	       "discard LBA range");
 	printf("\n\tor: vhd -d [vhdfile] -r[LBA]\t\t\t"
 	       "output specified LBA");
 	printf("\n\tor: vhd -d [vhdfile] -s[size]\t\t\t"
 	       "create vhdfile");
+	printf("\n\tor: vhd -d [vhdfile] -p [hex] -P [text] [-l range]\t"
+	       "search patterns");
+	printf("\n\tor: vhd -d [vhdxfile] -x [vhdfile]\t\t"
+	       "convert into fixed vhdfile");
+	printf("\n\tor: vhd -d [vhdfile] -n [newfile]\t\t"
+	       "clone vhdfile");
+	printf("\n\tor: vhd -d [vhdfile] -m\t\t\t\t"
+	       "show zero/data extents");
+	printf("\n\tor: vhd -c [vhdfile] -c [vhdfile] ... [-f]\t"
+	       "check vhdfiles");
 
 	printf("\n\nArguments:\n");
 	printf("\t-h\tshow help\n");
@@ -29,8 +44,19 @@ void usage()
 	       "(B, K/KB, M/MB, G/GB), range 4MB - 4GB\n");
 	printf("\t-r\tspecify LBA to read\n");
 	printf("\t-w\tspecify LBA to write\n");
+	printf("\t-t\tspecify LBA range to discard, eg. 0-2047\n");
 	printf("\t-d\tspecify vhdfile\n");
 	printf("\t-b\tspecify binfile\n");
+	printf("\t-j\tjournal all -w writes, commit them as one batch\n");
+	printf("\t-c\tspecify vhdfile to check, report in "
+	       "<file>\\t<item>\\t<OK|FAIL|FIXED>\\t<detail>\n");
+	printf("\t-f\trepair broken footer while checking\n");
+	printf("\t-p\tspecify hex pattern to search, eg. 55aa\n");
+	printf("\t-P\tspecify text pattern to search\n");
+	printf("\t-l\tspecify LBA range to search, eg. 0-2047\n");
+	printf("\t-x\tspecify fixed vhdfile to convert into\n");
+	printf("\t-n\tspecify new vhdfile to clone into\n");
+	printf("\t-m\tshow zero/data extents, cached in [vhdfile].map\n");
 	return;
 }
 
@@ -50,15 +76,24 @@ int main(int argc, char *argv[])
 		usage();
 	}
 
-	uint16_t *creator_versions;
-	int r_count = 0, w_count = 0, b_count = 0;
-	uint32_t r_args[argc], w_args[argc], s_arg = 0;
-	char *b_args[argc], *d_arg = NULL;
+	uint16_t creator_versions[2];
+	int r_count = 0, w_count = 0, b_count = 0, c_count = 0, f_flag = 0,
+	    m_flag = 0, j_flag = 0;
+	uint64_t r_args[argc], w_args[argc];
+	uint32_t s_arg = 0;
+	char *b_args[argc], *c_args[argc], *d_arg = NULL, *x_arg = NULL,
+	     *n_arg = NULL;
+	int p_count = 0;
+	struct search_pattern p_args[argc];
+	uint64_t l_start = 0, l_end = UINT64_MAX;
+	int t_count = 0;
+	uint64_t t_starts[argc], t_ends[argc];
+	uint8_t *bytes;
 
-	while ((ch = getopt(argc, argv, "vhr:w:d:b:s:")) != -1) {
+	while ((ch = getopt(argc, argv, "vhr:w:d:b:s:c:fp:P:l:mjx:n:t:")) != -1) {
 		switch (ch) {
 		case 'v':
-			creator_versions = get_version(CREATOR_VERSION);
+			get_version(CREATOR_VERSION, creator_versions);
 			printf("VHD %u.%u - A tool to r/w vhd\n",
 			       creator_versions[0], creator_versions[1]);
 			break;
@@ -82,22 +117,72 @@ int main(int argc, char *argv[])
 			}
 			break;
 		case 'r':
-			r_args[r_count] = atoi(optarg);
+			r_args[r_count] = strtoull(optarg, NULL, 10);
 			r_count++;
 			break;
 		case 'w':
-			w_args[w_count] = atoi(optarg);
+			w_args[w_count] = strtoull(optarg, NULL, 10);
 			w_count++;
 			break;
 		case 'b':
 			b_args[b_count] = optarg;
 			b_count++;
 			break;
+		case 'c':
+			c_args[c_count] = optarg;
+			c_count++;
+			break;
+		case 'f':
+			f_flag = 1;
+			break;
+		case 'p':
+			bytes = malloc(strlen(optarg) / 2 + 1);
+			p_args[p_count].len = parse_hex(optarg, bytes);
+			p_args[p_count].bytes = bytes;
+			p_count++;
+			break;
+		case 'P':
+			if (strlen(optarg) == 0) {
+				fprintf(stderr, "Empty pattern\n");
+				exit(1);
+			}
+			p_args[p_count].bytes = (uint8_t *)optarg;
+			p_args[p_count].len = strlen(optarg);
+			p_count++;
+			break;
+		case 'l':
+			parse_range(optarg, &l_start, &l_end);
+			break;
+		case 'm':
+			m_flag = 1;
+			break;
+		case 'j':
+			j_flag = 1;
+			break;
+		case 'x':
+			x_arg = optarg;
+			break;
+		case 'n':
+			n_arg = optarg;
+			break;
+		case 't':
+			parse_range(optarg, &t_starts[t_count],
+				    &t_ends[t_count]);
+			t_count++;
+			break;
 		default:
 			fprintf(stderr, "Undefined option: -%c\n", optopt);
 		}
 	}
 
+	// check vhdfiles, exit status tells if any of them is broken
+	if (c_count > 0) {
+		int broken = check_disks(c_args, c_count, f_flag);
+		if (!d_arg) {
+			return broken > 0;
+		}
+	}
+
 	// create vhdfile
 	if (s_arg > 0 && d_arg) {
 		printf("------------------------\n");
@@ -107,35 +192,73 @@ int main(int argc, char *argv[])
 	}
 
 	// print vhdfile's footer
-	uint32_t maxLBA = 0;
+	uint64_t maxLBA = 0;
+	uint32_t disk_type = DISK_TYPE_FIXED_HARD_DISK;
+	if (d_arg && access(d_arg, F_OK) != -1) {
+		// finish batch interrupted by crash before anything else
+		int replayed = journal_replay(d_arg);
+		if (replayed > 0) {
+			printf("Replay %d journaled writes into %s\n", replayed,
+			       d_arg);
+		}
+	}
+	int only_d = !s_arg && w_count <= 0 && r_count <= 0 && p_count <= 0 &&
+		     !m_flag && !x_arg && !n_arg && t_count <= 0;
+	int only_n = n_arg && !s_arg && w_count <= 0 && r_count <= 0 &&
+		     p_count <= 0 && !m_flag && !x_arg && t_count <= 0;
 	if (!d_arg) {
 		fprintf(stderr, "Not specify vhdfile\n");
+	} else if (only_n) {
+		// clone_disk validates footer itself, any size and disk type
+	} else if (is_vhdx(d_arg)) {
+		struct vhd_handle *handle = vhd_open(d_arg, 0);
+		maxLBA = handle->sectors - 1;
+		if (only_d) {
+			printf("------------------------\n");
+			printf("* FILE %s\n", d_arg);
+			printf("* LBA range: 0 - %lu\n", maxLBA);
+			printf("------------------------\n");
+			print_vhdx_info(handle);
+			printf("------------------------\n");
+		}
+		vhd_close(handle);
+		if (w_count > 0) {
+			fprintf(stderr, "VHDX %s can only be read\n", d_arg);
+			w_count = 0;
+		}
+		if (t_count > 0) {
+			fprintf(stderr, "VHDX %s can only be read\n", d_arg);
+			t_count = 0;
+		}
 	} else {
-		struct footer *footer = read_footer(d_arg);
-		maxLBA = bswap_16(footer->disk_geometry.cylinders) *
-				 footer->disk_geometry.heads *
-				 footer->disk_geometry.sectorsPerTrack -
-			 1;
-		if (!s_arg && w_count <= 0 && r_count <= 0) {
+		// no size limits, handle accepts any fixed or dynamic VHD
+		struct vhd_handle *handle = vhd_open(d_arg, 0);
+		struct footer *footer = &handle->footer;
+		disk_type = handle->disk_type;
+		maxLBA = handle->sectors - 1;
+		if (only_d) {
 			// only -d exists
 			printf("------------------------\n");
 			printf("* FILE %s\n", d_arg);
-			printf("* LBA range: 0 - %u\n", maxLBA);
+			printf("* LBA range: 0 - %lu\n", maxLBA);
 			printf("------------------------\n");
 			print_footer(footer);
 			printf("------------------------\n");
 		}
-		// free(footer);
+		vhd_close(handle);
 	}
 
 	// write bin into vhdfile
 	if (w_count > 0 && w_count == b_count && d_arg) {
 		printf("------------------------\n");
+		int valid[w_count], invalid = 0;
 		for (int i = 0; i < w_count; i++) {
+			valid[i] = 0;
 			// make sure start LBA in range
 			if (w_args[i] > maxLBA) {
-				fprintf(stderr, "LBA %u out of range: 0 - %u\n",
+				fprintf(stderr, "LBA %lu out of range: 0 - %lu\n",
 					w_args[i], maxLBA);
+				invalid++;
 				continue;
 			}
 			// make sure end LBA in range
@@ -144,26 +267,130 @@ int main(int argc, char *argv[])
 				fprintf(stderr,
 					"File %s size out of disk size\n",
 					b_args[i]);
+				invalid++;
 				continue;
 			}
-			write_fixed_disk_by_LBA(b_args[i], d_arg, w_args[i]);
-			printf("Write: VHD %s LBA %u <= BIN %s DONE\n", d_arg,
-			       w_args[i], b_args[i]);
+			valid[i] = 1;
+		}
+		if (j_flag && invalid > 0) {
+			// batch is all or nothing
+			fprintf(stderr, "Journal batch aborted, nothing written\n");
+			exit(1);
+		} else if (j_flag) {
+			struct journal *journal = journal_open(d_arg);
+			for (int i = 0; i < w_count; i++) {
+				journal_write_bin(journal, b_args[i],
+						  w_args[i]);
+			}
+			// all writes are committed as one batch
+			journal_close(journal);
+			for (int i = 0; i < w_count; i++) {
+				printf("Write: VHD %s LBA %lu <= BIN %s "
+				       "COMMITTED\n",
+				       d_arg, w_args[i], b_args[i]);
+			}
+		} else {
+			for (int i = 0; i < w_count; i++) {
+				if (!valid[i]) {
+					continue;
+				}
+				if (disk_type == DISK_TYPE_FIXED_HARD_DISK) {
+					write_fixed_disk_by_LBA(
+						b_args[i], d_arg, w_args[i]);
+				} else {
+					// dynamic disk LBAs are virtual, map via BAT
+					write_disk_by_LBA(b_args[i], d_arg,
+							  w_args[i]);
+				}
+				printf("Write: VHD %s LBA %lu <= BIN %s DONE\n",
+				       d_arg, w_args[i], b_args[i]);
+			}
 		}
 		printf("------------------------\n");
 	} else if (w_count > 0 && w_count != b_count && d_arg) {
 		fprintf(stderr, "-w -b not in pair\n");
 	}
 
+	// discard LBA ranges
+	if (t_count > 0 && d_arg) {
+		printf("------------------------\n");
+		struct vhd_handle *handle = vhd_open(d_arg, 1);
+		for (int i = 0; i < t_count; i++) {
+			uint64_t end = t_ends[i] < handle->sectors ?
+					       t_ends[i] :
+					       handle->sectors - 1;
+			if (t_starts[i] > end) {
+				fprintf(stderr, "LBA %lu out of range: 0 - %lu\n",
+					t_starts[i], handle->sectors - 1);
+				continue;
+			}
+			vhd_trim_sectors(handle, t_starts[i],
+					 end - t_starts[i] + 1);
+			printf("Trim: VHD %s LBA %lu - %lu DONE\n", d_arg,
+			       t_starts[i], end);
+		}
+		vhd_close(handle);
+		printf("------------------------\n");
+	}
+
 	// read LBA
 	if (r_count > 0 && d_arg) {
 		for (int i = 0; i < r_count; i++) {
 			printf("------------------------\n");
-			printf("* LBA %u of VHD %s\n", r_args[i], d_arg);
+			printf("* LBA %lu of VHD %s\n", r_args[i], d_arg);
 			printf("------------------------\n");
 			print_fixed_disk_by_LBA(d_arg, r_args[i]);
 			printf("------------------------\n");
 		}
 	}
+
+	// search patterns
+	if (p_count > 0 && d_arg) {
+		size_t nhits;
+		struct search_hit *hits = search_disk(d_arg, p_args, p_count,
+						      l_start, l_end, &nhits);
+		printf("------------------------\n");
+		for (size_t i = 0; i < nhits; i++) {
+			printf("LBA %lu offset %u: pattern %u\n", hits[i].LBA,
+			       hits[i].offset, hits[i].pattern);
+		}
+		printf("------------------------\n");
+		printf("%zu hits\n", nhits);
+		free(hits);
+	}
+
+	// convert into fixed VHD
+	if (x_arg && d_arg) {
+		printf("------------------------\n");
+		convert_to_fixed_disk(d_arg, x_arg);
+		printf("Convert: %s => VHD %s DONE\n", d_arg, x_arg);
+		printf("------------------------\n");
+	}
+
+	// clone vhdfile
+	if (n_arg && d_arg) {
+		printf("------------------------\n");
+		int reflinked = clone_disk(d_arg, n_arg);
+		printf("Clone: VHD %s => VHD %s DONE (%s)\n", d_arg, n_arg,
+		       reflinked ? "reflink" : "copy");
+		printf("------------------------\n");
+	}
+
+	// show allocation map
+	if (m_flag && d_arg) {
+		struct disk_map *map = map_disk(d_arg);
+		uint64_t data_LBAs = 0;
+		printf("------------------------\n");
+		for (uint32_t i = 0; i < map->count; i++) {
+			struct extent *e = &map->extents[i];
+			printf("%s LBA %u - %u (%u)\n", e->zero ? "zero" : "data",
+			       e->startLBA, e->startLBA + e->count - 1,
+			       e->count);
+			data_LBAs += e->zero ? 0 : e->count;
+		}
+		printf("------------------------\n");
+		printf("%lu LBAs hold data\n", data_LBAs);
+		free_disk_map(map);
+	}
 	return 0;
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "vhdlib.h"
 #include <ctype.h>
 #include <netinet/in.h>
@@ -8,32 +9,94 @@
 #include <unistd.h>
 #include <uuid/uuid.h>
 #include <byteswap.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <linux/fs.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 static void write_block(void *buffer, int bufferSize, FILE *fp);
 static void read_block(void *buffer, int bufferSize, FILE *fp);
+static uint32_t cal_checksum(const void *buffer, size_t len, uint32_t old);
+static void run_workers(void *(*worker)(void *), void *job, int jobs);
+static void pread_full(int fd, void *buffer, size_t len, uint64_t offset);
+static void pwrite_full(int fd, const void *buffer, size_t len,
+			uint64_t offset);
+static int is_zero(const uint8_t *buf, size_t len);
+static void create_fixed_disk_bytes(const char *filepath, uint64_t len_bytes);
+static void set_pending_file(const char *filepath);
 
 /*
  * Global variables
  */
 const size_t footer_size = sizeof(struct footer);
 
+/*
+ * Config
+ */
+#define SEARCH_CHUNK_BYTES (4 * 1024 * 1024) /* bytes scanned per job */
+#define MAP_CHUNK_BYTES (4 * 1024 * 1024) /* bytes scanned per job */
+#define CONVERT_CHUNK_BYTES (4 * 1024 * 1024) /* bytes copied per job */
+
+/*
+ * VHDX region and metadata item GUIDs
+ */
+static const struct uuid vhdx_bat_guid = {
+	0x2dc27766, 0xf623, 0x4200,
+	{ 0x9d, 0x64, 0x11, 0x5e, 0x9b, 0xfd, 0x4a, 0x08 }
+};
+static const struct uuid vhdx_metadata_guid = {
+	0x8b7ca206, 0x4790, 0x4b9a,
+	{ 0xb8, 0xfe, 0x57, 0x5f, 0x05, 0x0f, 0x88, 0x6e }
+};
+static const struct uuid vhdx_file_parameters_guid = {
+	0xcaa16737, 0xfa36, 0x4d43,
+	{ 0xb3, 0xb6, 0x33, 0xf0, 0xaa, 0x44, 0xe7, 0x6b }
+};
+static const struct uuid vhdx_virtual_disk_size_guid = {
+	0x2fa54224, 0xcd1b, 0x4876,
+	{ 0xb2, 0x11, 0x5d, 0xbe, 0xd8, 0x3b, 0xf4, 0xb8 }
+};
+static const struct uuid vhdx_logical_sector_size_guid = {
+	0x8141bf1d, 0xa96f, 0x4709,
+	{ 0xba, 0x47, 0xf2, 0x33, 0xa8, 0xfa, 0xab, 0x5f }
+};
+static const struct uuid vhdx_physical_sector_size_guid = {
+	0xcda348c7, 0x445d, 0x4471,
+	{ 0x9c, 0xc9, 0xe9, 0x88, 0x52, 0x51, 0xc5, 0x56 }
+};
+
 /*
  * Description:
  *     create specified size of new vhdfile
  */
 void create_fixed_disk(const char *filepath, uint32_t len_bytes)
 {
-	/* check if file already exists */
-	if (access(filepath, F_OK) != -1) {
-		fprintf(stderr, "File %s already exixts\n", filepath);
-		exit(1);
-	}
-
 	/* check file size */
 	if (len_bytes < VHD_MIN_BYTES || len_bytes > VHD_MAX_BYTES) {
 		fprintf(stderr, "Should specify size in 34KB - 4GB\n");
 		exit(1);
 	}
+	create_fixed_disk_bytes(filepath, len_bytes);
+}
+
+/*
+ * Description:
+ *     create new fixed vhdfile of len_bytes, up to VHD_FORMAT_MAX_BYTES
+ */
+static void create_fixed_disk_bytes(const char *filepath, uint64_t len_bytes)
+{
+	/* check if file already exists */
+	if (access(filepath, F_OK) != -1) {
+		fprintf(stderr, "File %s already exixts\n", filepath);
+		exit(1);
+	}
 
 	/* write zero bytes to specified len */
 	FILE *fp = fopen(filepath, "wb");
@@ -80,6 +143,8 @@ void create_fixed_disk(const char *filepath, uint32_t len_bytes)
 		.saved_state = SAVED_STATE_NO,
 	};
 
+	free(disk_geometry);
+
 	/* generate uuid */
 	uuid_generate((uint8_t *)&footer->uuid);
 
@@ -100,11 +165,38 @@ void create_fixed_disk(const char *filepath, uint32_t len_bytes)
 	printf("New VHD uuid: %s\n", uuid_str);
 }
 
+/*
+ * Half-written file, removed if the process exits before it is complete
+ */
+static const char *pending_file;
+
+static void remove_pending_file(void)
+{
+	if (pending_file) {
+		unlink(pending_file);
+	}
+}
+
+/*
+ * Description:
+ *     mark filepath to be removed on exit, NULL once it is complete
+ */
+static void set_pending_file(const char *filepath)
+{
+	static int registered;
+	if (!registered) {
+		atexit(remove_pending_file);
+		registered = 1;
+	}
+	pending_file = filepath;
+}
+
 /*
  * Description:
- *     print specified LBA in hex and ascii, similar to xxd
+ *     print specified LBA in hex and ascii, similar to xxd.
+ *     Works on fixed/dynamic VHD and VHDX, LBA size follows the disk.
  */
-void print_fixed_disk_by_LBA(const char *vhdfile, uint32_t LBA)
+void print_fixed_disk_by_LBA(const char *vhdfile, uint64_t LBA)
 {
 	/* check if file exists */
 	if (access(vhdfile, F_OK) == -1) {
@@ -112,28 +204,20 @@ void print_fixed_disk_by_LBA(const char *vhdfile, uint32_t LBA)
 		exit(1);
 	}
 
-	/* open file */
-	FILE *fp = fopen(vhdfile, "rb");
-	if (fp == NULL) {
-		fprintf(stderr, "Cannot open file %s\n", vhdfile);
-		exit(1);
-	}
-
-	/* move fp to LBA */
-	fseek(fp, LBA * 512, SEEK_SET);
-
 	/* read */
-	uint8_t buffer[512];
-	read_block(&buffer, sizeof(buffer), fp);
-	fclose(fp);
+	struct vhd_handle *handle = vhd_open(vhdfile, 0);
+	uint32_t sector_size = handle->sector_size;
+	uint8_t buffer[sector_size];
+	vhd_read_sectors(handle, LBA, 1, buffer);
+	vhd_close(handle);
 
-	uint32_t byteOffset = 0;
+	uint64_t byteOffset = 0;
 	uint64_t lineSum_0 = 0, lineSum_1 = 0;
 	char asciiStr_0[9], asciiStr_1[9];
-	for (uint16_t i = 0; i < 512; i += 2) {
+	for (uint16_t i = 0; i < sector_size; i += 2) {
 		if (i % 16 == 0) {
-			byteOffset = i + LBA * 512;
-			printf("%08x: ", byteOffset);
+			byteOffset = i + LBA * sector_size;
+			printf("%08lx: ", byteOffset);
 		}
 		printf("%02x%02x ", buffer[i], buffer[i + 1]);
 		if (i % 16 < 8) {
@@ -162,7 +246,7 @@ void print_fixed_disk_by_LBA(const char *vhdfile, uint32_t LBA)
  *     read bytes from input binfile, output into specified LBA of vhdfile
  */
 void write_fixed_disk_by_LBA(const char *binfile, const char *vhdfile,
-			     uint32_t LBA)
+			     uint64_t LBA)
 {
 	/* check if file exists */
 	if (access(binfile, F_OK) == -1) {
@@ -202,6 +286,39 @@ void write_fixed_disk_by_LBA(const char *binfile, const char *vhdfile,
 	fclose(output_fp);
 }
 
+/*
+ * Description:
+ *     read bytes from input binfile, output into specified virtual LBA of
+ *     vhdfile through disk handle, works on fixed and dynamic disks.
+ *     A partial last LBA keeps its old tail bytes.
+ */
+void write_disk_by_LBA(const char *binfile, const char *vhdfile, uint64_t LBA)
+{
+	FILE *input_fp = fopen(binfile, "rb");
+	if (input_fp == NULL) {
+		fprintf(stderr, "Cannot open file %s\n", binfile);
+		exit(1);
+	}
+	int input_size = get_filesize(binfile);
+	uint64_t count = (input_size + 511) / 512;
+	if (count == 0) {
+		fclose(input_fp);
+		return;
+	}
+
+	struct vhd_handle *handle = vhd_open(vhdfile, 1);
+	uint8_t *buffer = malloc(count * 512);
+	if (input_size % 512 != 0) {
+		vhd_read_sectors(handle, LBA + count - 1, 1,
+				 buffer + (count - 1) * 512);
+	}
+	read_block(buffer, input_size, input_fp);
+	fclose(input_fp);
+	vhd_write_sectors(handle, LBA, count, buffer);
+	vhd_close(handle);
+	free(buffer);
+}
+
 /*
  * Description:
  *     read file footer into struct Footer
@@ -254,7 +371,8 @@ void print_footer(const struct footer *footer)
 	}
 
 	/* file format version */
-	uint16_t *format_versions = get_version(footer->file_format_version);
+	uint16_t format_versions[2];
+	get_version(footer->file_format_version, format_versions);
 	printf("file format version: %u.%u\n", format_versions[0],
 	       format_versions[1]);
 
@@ -266,9 +384,10 @@ void print_footer(const struct footer *footer)
 		bswap_32(footer->time_stamp) +
 		SECONDS_OFFSET; /* get seconds start from 1970 */
 	time_t timer = unix_timestamp;
-	struct tm *info = localtime(&timer);
+	struct tm info;
+	localtime_r(&timer, &info);
 	char buffer[80];
-	strftime(buffer, 80, "%Y-%m-%d %H:%M:%S", info);
+	strftime(buffer, 80, "%Y-%m-%d %H:%M:%S", &info);
 	printf("time stamp: 0x%08x (%s)\n", unix_timestamp, buffer);
 
 	/* creator application */
@@ -277,7 +396,8 @@ void print_footer(const struct footer *footer)
 	printf("creator application: %s\n", app_str);
 
 	/* creator version */
-	uint16_t *creator_versions = get_version(footer->creator_version);
+	uint16_t creator_versions[2];
+	get_version(footer->creator_version, creator_versions);
 	printf("creator version: %u.%u\n", creator_versions[0],
 	       creator_versions[1]);
 
@@ -365,6 +485,544 @@ void print_footer(const struct footer *footer)
 	}
 }
 
+/*
+ * Description:
+ *     append one line to the check report,
+ *     format: <vhdfile>\t<item>\t<OK|FAIL|FIXED>\t<detail>
+ */
+static void report_line(FILE *report, const char *vhdfile, const char *item,
+			const char *status, const char *detail)
+{
+	fprintf(report, "%s\t%s\t%s\t%s\n", vhdfile, item, status, detail);
+}
+
+/*
+ * Description:
+ *     compare two BAT sector offsets, used by qsort
+ */
+static int cmp_bat_entry(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Description:
+ *     check dynamic header and BAT of a dynamic/differencing disk,
+ *     return number of failed items
+ */
+static int check_dynamic_disk(int fd, const char *vhdfile, uint64_t filesize,
+			      const struct footer *footer, FILE *report)
+{
+	int failed = 0;
+	char detail[128];
+
+	/* dynamic header */
+	struct dynamic_header header;
+	uint64_t header_offset = bswap_64(footer->data_offset);
+	if (header_offset > filesize - 512 ||
+	    filesize - 512 - header_offset < sizeof(header) ||
+	    pread(fd, &header, sizeof(header), header_offset) !=
+		    sizeof(header)) {
+		snprintf(detail, sizeof(detail),
+			 "header offset 0x%lx out of file", header_offset);
+		report_line(report, vhdfile, "header", "FAIL", detail);
+		return failed + 1;
+	}
+	if (header.cookie != DYNAMIC_HEADER_COOKIE) {
+		report_line(report, vhdfile, "header_cookie", "FAIL",
+			    "cookie is not cxsparse");
+		return failed + 1;
+	}
+	report_line(report, vhdfile, "header_cookie", "OK", "cxsparse");
+
+	uint32_t stored = header.checksum;
+	uint32_t expected = bswap_32(~cal_checksum(&header, sizeof(header),
+						   header.checksum));
+	snprintf(detail, sizeof(detail), "stored 0x%08x expected 0x%08x",
+		 bswap_32(stored), bswap_32(expected));
+	if (stored != expected) {
+		report_line(report, vhdfile, "header_checksum", "FAIL", detail);
+		failed++;
+	} else {
+		report_line(report, vhdfile, "header_checksum", "OK", detail);
+	}
+
+	/* block size must be a power of two and sector aligned */
+	uint32_t block_size = bswap_32(header.block_size);
+	snprintf(detail, sizeof(detail), "block size %u", block_size);
+	if (block_size < 512 || (block_size & (block_size - 1)) != 0) {
+		report_line(report, vhdfile, "block_alignment", "FAIL", detail);
+		return failed + 1;
+	}
+	report_line(report, vhdfile, "block_alignment", "OK", detail);
+
+	/* BAT itself */
+	uint64_t table_offset = bswap_64(header.table_offset);
+	uint32_t entries = bswap_32(header.max_table_entries);
+	uint64_t current_size = bswap_64(footer->current_size);
+	uint64_t covered = (uint64_t)entries * block_size;
+	snprintf(detail, sizeof(detail), "%u entries cover %lu of %lu Bytes",
+		 entries, covered, current_size);
+	if (covered < current_size) {
+		report_line(report, vhdfile, "bat_size", "FAIL", detail);
+		failed++;
+	} else {
+		report_line(report, vhdfile, "bat_size", "OK", detail);
+	}
+	uint64_t table_bytes = (uint64_t)entries * sizeof(uint32_t);
+	if (table_offset % 512 != 0 || table_offset > filesize - 512 ||
+	    filesize - 512 - table_offset < table_bytes) {
+		snprintf(detail, sizeof(detail),
+			 "BAT 0x%lx + %lu Bytes out of file", table_offset,
+			 table_bytes);
+		report_line(report, vhdfile, "bat", "FAIL", detail);
+		return failed + 1;
+	}
+	uint32_t *bat = malloc(table_bytes + 1);
+	if (pread(fd, bat, table_bytes, table_offset) != (ssize_t)table_bytes) {
+		report_line(report, vhdfile, "bat", "FAIL", "cannot read BAT");
+		free(bat);
+		return failed + 1;
+	}
+
+	/*
+	 * every allocated block is a sector bitmap (padded to 512 Bytes)
+	 * followed by block data, and must lie between BAT and footer
+	 */
+	uint64_t bitmap_bytes = ((block_size / 512 / 8) + 511) / 512 * 512;
+	uint64_t block_sectors = (bitmap_bytes + block_size) / 512;
+	uint64_t first_sector = (table_offset + table_bytes + 511) / 512;
+	uint64_t last_sector = (filesize - 512) / 512;
+	uint32_t allocated = 0;
+	int bad_range = 0;
+	for (uint32_t i = 0; i < entries; i++) {
+		if (bat[i] == BAT_ENTRY_UNUSED) {
+			continue;
+		}
+		uint64_t sector = bswap_32(bat[i]);
+		if (sector < first_sector ||
+		    sector + block_sectors > last_sector) {
+			if (!bad_range) {
+				snprintf(detail, sizeof(detail),
+					 "block %u at sector %lu out of "
+					 "data area",
+					 i, sector);
+			}
+			bad_range++;
+		}
+		bat[allocated++] = sector;
+	}
+	if (bad_range) {
+		report_line(report, vhdfile, "bat_range", "FAIL", detail);
+		failed++;
+	} else {
+		snprintf(detail, sizeof(detail), "%u of %u blocks allocated",
+			 allocated, entries);
+		report_line(report, vhdfile, "bat_range", "OK", detail);
+	}
+
+	/* sort allocated blocks by position, neighbours must not overlap */
+	qsort(bat, allocated, sizeof(uint32_t), cmp_bat_entry);
+	int overlaps = 0;
+	for (uint32_t i = 1; i < allocated; i++) {
+		if ((uint64_t)bat[i - 1] + block_sectors > bat[i]) {
+			if (!overlaps) {
+				snprintf(detail, sizeof(detail),
+					 "blocks at sector %u and %u overlap",
+					 bat[i - 1], bat[i]);
+			}
+			overlaps++;
+		}
+	}
+	if (overlaps) {
+		report_line(report, vhdfile, "bat_overlap", "FAIL", detail);
+		failed++;
+	} else {
+		report_line(report, vhdfile, "bat_overlap", "OK",
+			    "no overlapping blocks");
+	}
+	free(bat);
+	return failed;
+}
+
+/*
+ * Description:
+ *     verify footer, footer copy, dynamic header and BAT of vhdfile,
+ *     write one line per item into report, return number of failed items.
+ *     If repair is set, a broken footer of dynamic/differencing disk is
+ *     rewritten from a valid copy, otherwise with recalculated checksum.
+ *     A footer with broken cookie is never repaired.
+ */
+int check_disk(const char *vhdfile, int repair, FILE *report)
+{
+	int failed = 0;
+	char detail[128];
+
+	int fd = open(vhdfile, repair ? O_RDWR : O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		report_line(report, vhdfile, "open", "FAIL", "cannot open file");
+		if (fd != -1) {
+			close(fd);
+		}
+		return 1;
+	}
+	uint64_t filesize = st.st_size;
+	if (filesize < 512) {
+		snprintf(detail, sizeof(detail), "file size %lu too small",
+			 filesize);
+		report_line(report, vhdfile, "size", "FAIL", detail);
+		close(fd);
+		return 1;
+	}
+
+	/* footer at end of file, and its copy at beginning */
+	uint8_t footer_buf[512], copy_buf[512];
+	struct footer *footer = (struct footer *)footer_buf;
+	struct footer *copy = (struct footer *)copy_buf;
+	if (pread(fd, footer_buf, 512, filesize - 512) != 512 ||
+	    pread(fd, copy_buf, 512, 0) != 512) {
+		report_line(report, vhdfile, "footer", "FAIL",
+			    "cannot read footer");
+		close(fd);
+		return 1;
+	}
+
+	int cookie_ok = footer->cookie == DEFAULT_COOKIE;
+	uint32_t expected = bswap_32(
+		~cal_checksum(footer, footer_size, footer->checksum));
+	int checksum_ok = footer->checksum == expected;
+	/*
+	 * only dynamic/differencing disks keep a copy at offset 0, on fixed
+	 * disks it is guest data, so disk type must come from a footer with
+	 * valid cookie
+	 */
+	int has_copy = cookie_ok &&
+		       (footer->disk_type == DISK_TYPE_DYNAMIC_HARD_DISK ||
+			footer->disk_type == DISK_TYPE_DIFFERENCING_HARD_DISK);
+	int copy_ok = has_copy && copy->cookie == DEFAULT_COOKIE &&
+		      copy->disk_type == footer->disk_type &&
+		      copy->checksum == bswap_32(~cal_checksum(
+						copy, footer_size,
+						copy->checksum));
+
+	report_line(report, vhdfile, "footer_cookie", cookie_ok ? "OK" : "FAIL",
+		    cookie_ok ? "conectix" : "cookie is not conectix");
+	snprintf(detail, sizeof(detail), "stored 0x%08x expected 0x%08x",
+		 bswap_32(footer->checksum), bswap_32(expected));
+	report_line(report, vhdfile, "footer_checksum",
+		    checksum_ok ? "OK" : "FAIL", detail);
+
+	if (!cookie_ok || !checksum_ok) {
+		failed += !cookie_ok + !checksum_ok;
+		/* candidate fix, footer_buf keeps what is on disk until written */
+		uint8_t fixed_buf[512];
+		const char *fix = NULL;
+		if (copy_ok) {
+			/* trust the copy of dynamic disk */
+			memcpy(fixed_buf, copy_buf, 512);
+			fix = "footer restored from copy";
+		} else if (cookie_ok) {
+			memcpy(fixed_buf, footer_buf, 512);
+			fillin_checksum((struct footer *)fixed_buf);
+			fix = "footer checksum recalculated";
+		}
+		if (repair && fix &&
+		    pwrite(fd, fixed_buf, 512, filesize - 512) == 512) {
+			memcpy(footer_buf, fixed_buf, 512);
+			report_line(report, vhdfile, "footer", "FIXED", fix);
+			failed -= !cookie_ok + !checksum_ok;
+			cookie_ok = checksum_ok = 1;
+		}
+	}
+	if (!cookie_ok) {
+		close(fd);
+		return failed;
+	}
+
+	uint32_t disk_type = footer->disk_type;
+	uint64_t current_size = bswap_64(footer->current_size);
+	if (disk_type == DISK_TYPE_FIXED_HARD_DISK) {
+		snprintf(detail, sizeof(detail),
+			 "current size %lu, file size %lu", current_size,
+			 filesize);
+		if (filesize < VHD_MIN_BYTES + 512 ||
+		    current_size + 512 != filesize) {
+			report_line(report, vhdfile, "fixed_size", "FAIL",
+				    detail);
+			failed++;
+		} else {
+			report_line(report, vhdfile, "fixed_size", "OK",
+				    detail);
+		}
+	} else if (disk_type == DISK_TYPE_DYNAMIC_HARD_DISK ||
+		   disk_type == DISK_TYPE_DIFFERENCING_HARD_DISK) {
+		/* copy at beginning should be identical to footer */
+		if (memcmp(footer_buf, copy_buf, 512) != 0) {
+			if (repair && checksum_ok &&
+			    pwrite(fd, footer_buf, 512, 0) == 512) {
+				report_line(report, vhdfile, "footer_copy",
+					    "FIXED", "copy rewritten from footer");
+			} else {
+				report_line(report, vhdfile, "footer_copy",
+					    "FAIL", "copy differs from footer");
+				failed++;
+			}
+		} else {
+			report_line(report, vhdfile, "footer_copy", "OK",
+				    "copy matches footer");
+		}
+		failed += check_dynamic_disk(fd, vhdfile, filesize, footer,
+					     report);
+	} else {
+		report_line(report, vhdfile, "disk_type", "FAIL",
+			    "unsupported disk type");
+		failed++;
+	}
+
+	close(fd);
+	return failed;
+}
+
+struct check_job {
+	char *const *vhdfiles;
+	int count;
+	int next; /* index of next vhdfile, taken atomically */
+	int repair;
+	char **reports;
+	int *failed;
+};
+
+static void *check_worker(void *arg)
+{
+	struct check_job *job = arg;
+	int i;
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+	       job->count) {
+		size_t len;
+		FILE *report = open_memstream(&job->reports[i], &len);
+		job->failed[i] = check_disk(job->vhdfiles[i], job->repair,
+					    report);
+		fclose(report);
+	}
+	return NULL;
+}
+
+/*
+ * Description:
+ *     check vhdfiles in parallel, print reports to stdout in input order,
+ *     return number of vhdfiles with failed items
+ */
+int check_disks(char *const vhdfiles[], int count, int repair)
+{
+	struct check_job job = {
+		.vhdfiles = vhdfiles,
+		.count = count,
+		.next = 0,
+		.repair = repair,
+		.reports = calloc(count, sizeof(char *)),
+		.failed = calloc(count, sizeof(int)),
+	};
+
+	run_workers(check_worker, &job, count);
+
+	int broken = 0;
+	for (int i = 0; i < count; i++) {
+		fputs(job.reports[i], stdout);
+		free(job.reports[i]);
+		broken += job.failed[i] > 0;
+	}
+	free(job.reports);
+	free(job.failed);
+	return broken;
+}
+
+struct hit_list {
+	struct search_hit *hits;
+	size_t count;
+	size_t cap;
+};
+
+struct search_job {
+	struct vhd_handle *handle;
+	const struct search_pattern *patterns;
+	int npatterns;
+	size_t overlap; /* longest pattern len - 1 */
+	uint64_t start; /* first byte of range */
+	uint64_t end; /* last byte of range + 1 */
+	uint32_t nchunks;
+	uint32_t next; /* index of next chunk, taken atomically */
+	struct hit_list *results; /* one list per chunk */
+};
+
+/*
+ * Description:
+ *     verify every pattern at buf[i], append matches to list
+ */
+static void match_at(const uint8_t *buf, size_t len, size_t i,
+		     const struct search_pattern *patterns, int npatterns,
+		     uint64_t base, uint32_t sector_size,
+		     struct hit_list *list)
+{
+	for (int k = 0; k < npatterns; k++) {
+		if (i + patterns[k].len > len ||
+		    memcmp(buf + i, patterns[k].bytes, patterns[k].len) != 0) {
+			continue;
+		}
+		if (list->count == list->cap) {
+			list->cap = list->cap ? list->cap * 2 : 16;
+			list->hits = realloc(list->hits,
+					     list->cap * sizeof(*list->hits));
+		}
+		uint64_t pos = base + i;
+		list->hits[list->count++] = (struct search_hit){
+			.LBA = pos / sector_size,
+			.offset = pos % sector_size,
+			.pattern = k,
+		};
+	}
+}
+
+/*
+ * Description:
+ *     find all patterns starting in buf[0, limit), buf holds len bytes.
+ *     With SSE2, 16 positions are filtered at once by the first two bytes
+ *     of every pattern, only candidates are verified by memcmp.
+ */
+static void scan_chunk(const uint8_t *buf, size_t len, size_t limit,
+		       const struct search_pattern *patterns, int npatterns,
+		       uint64_t base, uint32_t sector_size,
+		       struct hit_list *list)
+{
+	size_t i = 0;
+#if defined(__SSE2__)
+	__m128i first[npatterns], second[npatterns];
+	for (int k = 0; k < npatterns; k++) {
+		first[k] = _mm_set1_epi8(patterns[k].bytes[0]);
+		second[k] = _mm_set1_epi8(
+			patterns[k].len > 1 ? patterns[k].bytes[1] : 0);
+	}
+	for (; i + 17 <= len && i < limit; i += 16) {
+		__m128i b0 = _mm_loadu_si128((const __m128i *)(buf + i));
+		__m128i b1 = _mm_loadu_si128((const __m128i *)(buf + i + 1));
+		uint32_t mask = 0;
+		for (int k = 0; k < npatterns; k++) {
+			__m128i eq = _mm_cmpeq_epi8(b0, first[k]);
+			if (patterns[k].len > 1) {
+				eq = _mm_and_si128(
+					eq, _mm_cmpeq_epi8(b1, second[k]));
+			}
+			mask |= _mm_movemask_epi8(eq);
+		}
+		if (limit - i < 16) {
+			mask &= (1U << (limit - i)) - 1;
+		}
+		while (mask) {
+			int bit = __builtin_ctz(mask);
+			match_at(buf, len, i + bit, patterns, npatterns, base,
+				 sector_size, list);
+			mask &= mask - 1;
+		}
+	}
+#endif
+	for (; i < limit && i < len; i++) {
+		match_at(buf, len, i, patterns, npatterns, base, sector_size,
+			 list);
+	}
+}
+
+static void *search_worker(void *arg)
+{
+	struct search_job *job = arg;
+	uint32_t ss = job->handle->sector_size;
+	uint8_t *buf = malloc(SEARCH_CHUNK_BYTES + job->overlap + ss);
+	uint32_t c;
+	while ((c = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+	       job->nchunks) {
+		/*
+		 * read overlap bytes past chunk end, so patterns crossing
+		 * the boundary are found by the chunk they start in
+		 */
+		uint64_t base = job->start + (uint64_t)c * SEARCH_CHUNK_BYTES;
+		uint64_t limit = job->end - base < SEARCH_CHUNK_BYTES ?
+					 job->end - base :
+					 SEARCH_CHUNK_BYTES;
+		uint64_t want = job->end - base < limit + job->overlap ?
+					job->end - base :
+					limit + job->overlap;
+		/* whole LBAs, range end is always LBA aligned */
+		want = (want + ss - 1) / ss * ss;
+		vhd_read_sectors(job->handle, base / ss, want / ss, buf);
+		scan_chunk(buf, want, limit, job->patterns, job->npatterns,
+			   base, ss, &job->results[c]);
+	}
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Description:
+ *     search patterns in LBA range [startLBA, endLBA] of virtual disk,
+ *     return hits sorted by position, count stored into nhits.
+ *     A pattern must lie entirely inside the range to be reported.
+ */
+struct search_hit *search_disk(const char *vhdfile,
+			       const struct search_pattern *patterns,
+			       int npatterns, uint64_t startLBA,
+			       uint64_t endLBA, size_t *nhits)
+{
+	struct vhd_handle *handle = vhd_open(vhdfile, 0);
+	uint32_t ss = handle->sector_size;
+	uint64_t disk_bytes = handle->sectors * ss;
+	/* clamp LBAs before scaling, "100-" ends at UINT64_MAX */
+	uint64_t start = startLBA < handle->sectors ? startLBA * ss : disk_bytes;
+	uint64_t end = endLBA < handle->sectors ? (endLBA + 1) * ss : disk_bytes;
+	*nhits = 0;
+	if (start >= end || npatterns <= 0) {
+		vhd_close(handle);
+		return NULL;
+	}
+
+	size_t maxlen = 1;
+	for (int i = 0; i < npatterns; i++) {
+		if (patterns[i].len > maxlen) {
+			maxlen = patterns[i].len;
+		}
+	}
+
+	struct search_job job = {
+		.handle = handle,
+		.patterns = patterns,
+		.npatterns = npatterns,
+		.overlap = maxlen - 1,
+		.start = start,
+		.end = end,
+		.nchunks = (end - start + SEARCH_CHUNK_BYTES - 1) /
+			   SEARCH_CHUNK_BYTES,
+		.next = 0,
+	};
+	job.results = calloc(job.nchunks, sizeof(struct hit_list));
+
+	run_workers(search_worker, &job, job.nchunks);
+	vhd_close(handle);
+
+	/* chunks are in disk order, so concatenation keeps hits sorted */
+	size_t total = 0;
+	for (uint32_t c = 0; c < job.nchunks; c++) {
+		total += job.results[c].count;
+	}
+	struct search_hit *hits = malloc((total ? total : 1) * sizeof(*hits));
+	for (uint32_t c = 0; c < job.nchunks; c++) {
+		memcpy(hits + *nhits, job.results[c].hits,
+		       job.results[c].count * sizeof(*hits));
+		*nhits += job.results[c].count;
+		free(job.results[c].hits);
+	}
+	free(job.results);
+	return hits;
+}
+
 /*
  * Description:
  *     get size (byte) of a file
@@ -418,6 +1076,42 @@ static void read_block(void *buffer, int bufferSize, FILE *fp)
 	}
 }
 
+/*
+ * Description:
+ *     number of worker threads for jobs, limited by online cpus
+ */
+static int get_nthreads(int jobs)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) {
+		cpus = 1;
+	}
+	return jobs < cpus ? (jobs > 0 ? jobs : 1) : cpus;
+}
+
+/*
+ * Description:
+ *     run worker on job in a pool of threads, sized for jobs. Workers take
+ *     jobs by an atomic index, so if threads cannot be created the caller
+ *     runs worker inline and finishes whatever is left.
+ */
+static void run_workers(void *(*worker)(void *), void *job, int jobs)
+{
+	int nthreads = get_nthreads(jobs);
+	pthread_t threads[nthreads];
+	int started = 0;
+	while (started < nthreads &&
+	       pthread_create(&threads[started], NULL, worker, job) == 0) {
+		started++;
+	}
+	if (started < nthreads) {
+		worker(job);
+	}
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
 /*
  * Description:
  *     parse size string into byte num, eg. "1MB" => 1048576
@@ -449,67 +1143,1811 @@ uint32_t parse_size(const char *sizeStr)
 	return sizeNum;
 }
 
+struct extent_list {
+	struct extent *extents;
+	uint32_t count;
+	uint32_t cap;
+};
+
 /*
  * Description:
- *     covert ascii hex number to string
- *
- * Params:
- *     - hex: length shorter than 64 bit
- *     - str: char array, length should be char nums + 1
- *     ('\0' need to be append to this array)
- *     - len_bytes: sizeof(str), number of bytes in str including '\0'
- *
- * Notice:
- *     - cannot sizeof(str) in this function to get len_bytes,
- *     because sizeof() return len of ptr, not len of arr
- *     - some special byte may cause result str cannot be print by %s.
- *     eg.0x00 corresponding to char '\0'
- *     - visual char range: 0x20 - 0x7e
- *     - the index of last byte in str is actually len_bytes-1
+ *     append LBAs to list, coalesce with last extent of same kind
  */
-void hex2str(uint64_t hex, char *str, int len_bytes)
+static void extent_append(struct extent_list *list, uint32_t startLBA,
+			  uint32_t count, uint32_t zero)
 {
-	uint8_t mask = 0xff;
-	for (int i = 0; i < (len_bytes - 1); i++) {
-		uint8_t code = (hex >> (i * 8)) & mask;
-		if (code >= 0x20 && code <= 0x7e) {
-			str[i] = toascii(code);
-		} else {
-			/* replace invisual char with '.' */
-			str[i] = '.';
+	if (count == 0) {
+		return;
+	}
+	if (list->count > 0) {
+		struct extent *last = &list->extents[list->count - 1];
+		if (last->zero == zero &&
+		    last->startLBA + last->count == startLBA) {
+			last->count += count;
+			return;
 		}
 	}
-	str[len_bytes - 1] = '\0';
+	if (list->count == list->cap) {
+		list->cap = list->cap ? list->cap * 2 : 16;
+		list->extents =
+			realloc(list->extents, list->cap * sizeof(struct extent));
+	}
+	list->extents[list->count++] = (struct extent){
+		.startLBA = startLBA,
+		.count = count,
+		.zero = zero,
+	};
 }
 
 /*
  * Description:
- *     Authority-defined algorithm to get CHS from size
+ *     check if all bytes of buffer are zero, len should be multiple of 64
  */
-struct disk_geometry *cal_CHS(uint32_t totalSectors)
+static int is_zero(const uint8_t *buf, size_t len)
 {
-	uint32_t cylinderTimesHeads;
-	uint16_t cylinders;
-	uint8_t heads, sectorsPerTrack;
-
-	if (totalSectors > 65535 * 16 * 255) {
-		totalSectors =
-			65535 * 16 *
-			255; /* disk max size = 2^28 * 512 Byte = 128 GB */
+#if defined(__SSE2__)
+	__m128i acc = _mm_setzero_si128();
+	for (size_t i = 0; i < len; i += 64) {
+		const __m128i *p = (const __m128i *)(buf + i);
+		acc = _mm_or_si128(acc, _mm_or_si128(_mm_loadu_si128(p),
+						     _mm_loadu_si128(p + 1)));
+		acc = _mm_or_si128(acc, _mm_or_si128(_mm_loadu_si128(p + 2),
+						     _mm_loadu_si128(p + 3)));
 	}
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) ==
+	       0xffff;
+#else
+	return buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0;
+#endif
+}
 
-	if (totalSectors >= 65535 * 16 * 63) { /* when disk size >= 32 GB */
-		sectorsPerTrack = 255;
-		heads = 16;
-		cylinderTimesHeads = totalSectors / sectorsPerTrack;
-	} else {
-		sectorsPerTrack = 17;
-		cylinderTimesHeads = totalSectors / sectorsPerTrack;
+struct map_segment {
+	uint64_t offset;
+	uint64_t len;
+	int hole; /* no need to read */
+	struct extent_list result;
+};
 
-		heads = (cylinderTimesHeads + 1023) / 1024;
+struct map_job {
+	int fd;
+	struct map_segment *segments;
+	uint32_t nsegments;
+	uint32_t next; /* index of next segment, taken atomically */
+};
 
-		if (heads < 4) {
-			heads = 4;
+static void *map_worker(void *arg)
+{
+	struct map_job *job = arg;
+	uint8_t *buf = malloc(MAP_CHUNK_BYTES);
+	uint32_t i;
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+	       job->nsegments) {
+		struct map_segment *seg = &job->segments[i];
+		uint32_t LBA = seg->offset / 512;
+		if (seg->hole) {
+			extent_append(&seg->result, LBA, seg->len / 512, 1);
+			continue;
+		}
+		ssize_t len = pread(job->fd, buf, seg->len, seg->offset);
+		if (len < (ssize_t)seg->len) {
+			/* short read, treat unread part as zero */
+			memset(buf + (len > 0 ? len : 0), 0,
+			       seg->len - (len > 0 ? len : 0));
+		}
+		for (uint32_t j = 0; j < seg->len / 512; j++) {
+			extent_append(&seg->result, LBA + j, 1,
+				      is_zero(buf + j * 512, 512));
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Description:
+ *     append segments of [offset, offset + len) to array, data ranges are
+ *     cut into MAP_CHUNK_BYTES pieces so they can be scanned in parallel
+ */
+static void add_segments(struct map_segment **segments, uint32_t *count,
+			 uint32_t *cap, uint64_t offset, uint64_t len, int hole)
+{
+	while (len > 0) {
+		uint64_t piece = hole || len < MAP_CHUNK_BYTES ?
+					 len :
+					 MAP_CHUNK_BYTES;
+		if (*count == *cap) {
+			*cap = *cap ? *cap * 2 : 16;
+			*segments = realloc(*segments,
+					    *cap * sizeof(struct map_segment));
+		}
+		(*segments)[(*count)++] = (struct map_segment){
+			.offset = offset,
+			.len = piece,
+			.hole = hole,
+		};
+		offset += piece;
+		len -= piece;
+	}
+}
+
+/*
+ * Description:
+ *     scan data area [0, data_bytes) of fd into zero/non-zero extents,
+ *     holes reported by filesystem are zero without reading
+ */
+static void scan_disk_map(int fd, uint64_t data_bytes, struct disk_map *map)
+{
+	struct map_segment *segments = NULL;
+	uint32_t count = 0, cap = 0;
+
+	uint64_t pos = 0;
+	while (pos < data_bytes) {
+		off_t data = lseek(fd, pos, SEEK_DATA);
+		if (data == -1 && errno == ENXIO) {
+			data = data_bytes; /* hole till end of file */
+		} else if (data == -1) {
+			data = pos; /* no hole info, read everything */
+		}
+		/* keep segments LBA aligned */
+		data = data / 512 * 512;
+		if ((uint64_t)data > data_bytes) {
+			data = data_bytes;
+		}
+		add_segments(&segments, &count, &cap, pos, data - pos, 1);
+		if ((uint64_t)data >= data_bytes) {
+			break;
+		}
+		off_t hole = lseek(fd, data, SEEK_HOLE);
+		if (hole == -1 || (uint64_t)hole > data_bytes) {
+			hole = data_bytes;
+		}
+		hole = (hole + 511) / 512 * 512;
+		add_segments(&segments, &count, &cap, data, hole - data, 0);
+		pos = hole;
+	}
+
+	struct map_job job = {
+		.fd = fd,
+		.segments = segments,
+		.nsegments = count,
+		.next = 0,
+	};
+	run_workers(map_worker, &job, count);
+
+	/* segments are in disk order, merge neighbours of same kind */
+	struct extent_list list = { 0 };
+	for (uint32_t i = 0; i < count; i++) {
+		struct extent_list *r = &segments[i].result;
+		for (uint32_t j = 0; j < r->count; j++) {
+			extent_append(&list, r->extents[j].startLBA,
+				      r->extents[j].count, r->extents[j].zero);
+		}
+		free(r->extents);
+	}
+	free(segments);
+	map->count = list.count;
+	map->extents = list.extents;
+}
+
+/*
+ * Description:
+ *     load sidecar map, return NULL if missing or not matching key
+ */
+static struct disk_map *load_disk_map(const char *mappath,
+				      const struct disk_map *key)
+{
+	FILE *fp = fopen(mappath, "rb");
+	if (fp == NULL) {
+		return NULL;
+	}
+	struct disk_map *map = malloc(sizeof(*map));
+	if (map == NULL) {
+		fclose(fp);
+		return NULL;
+	}
+	size_t header_len = offsetof(struct disk_map, extents);
+	/* every extent holds at least one LBA of the disk */
+	if (fread(map, header_len, 1, fp) != 1 ||
+	    map->cookie != key->cookie || map->version != key->version ||
+	    memcmp(&map->uuid, &key->uuid, sizeof(map->uuid)) != 0 ||
+	    map->mtime_sec != key->mtime_sec ||
+	    map->mtime_nsec != key->mtime_nsec || map->size != key->size ||
+	    map->count > (key->size - 512) / 512) {
+		fclose(fp);
+		free(map);
+		return NULL;
+	}
+	map->extents = malloc((map->count ? map->count : 1) *
+			      sizeof(struct extent));
+	if (map->extents == NULL ||
+	    fread(map->extents, sizeof(struct extent), map->count, fp) !=
+		    map->count) {
+		fclose(fp);
+		free_disk_map(map);
+		return NULL;
+	}
+	fclose(fp);
+	return map;
+}
+
+/*
+ * Description:
+ *     store map into sidecar, written into a unique temp file then
+ *     renamed, so concurrent writers never share a temp file and a
+ *     reader never sees a partial map
+ */
+static void save_disk_map(const char *mappath, const struct disk_map *map)
+{
+	char tmppath[strlen(mappath) + 8];
+	sprintf(tmppath, "%s.XXXXXX", mappath);
+	int fd = mkstemp(tmppath);
+	if (fd == -1) {
+		return; /* cache is optional, eg. read-only directory */
+	}
+	FILE *fp = fdopen(fd, "wb");
+	if (fp == NULL) {
+		close(fd);
+		unlink(tmppath);
+		return;
+	}
+	size_t header_len = offsetof(struct disk_map, extents);
+	int ok = fchmod(fd, 0644) == 0 &&
+		 fwrite(map, header_len, 1, fp) == 1 &&
+		 fwrite(map->extents, sizeof(struct extent), map->count, fp) ==
+			 map->count;
+	ok = fclose(fp) == 0 && ok;
+	if (!ok || rename(tmppath, mappath) != 0) {
+		unlink(tmppath);
+	}
+}
+
+/*
+ * Description:
+ *     get zero/non-zero extents of fixed disk vhdfile. The result is cached
+ *     in [vhdfile].map keyed on uuid, mtime and size of vhdfile, and reused
+ *     until vhdfile changes.
+ */
+struct disk_map *map_disk(const char *vhdfile)
+{
+	int fd = open(vhdfile, O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		fprintf(stderr, "Cannot open file %s\n", vhdfile);
+		exit(1);
+	}
+	struct footer footer;
+	if (st.st_size < 512 ||
+	    pread(fd, &footer, footer_size, st.st_size - 512) !=
+		    (ssize_t)footer_size ||
+	    footer.cookie != DEFAULT_COOKIE) {
+		fprintf(stderr, "File %s is not a VHD\n", vhdfile);
+		exit(1);
+	}
+	if (footer.disk_type != DISK_TYPE_FIXED_HARD_DISK) {
+		fprintf(stderr, "File %s is not a fixed disk\n", vhdfile);
+		exit(1);
+	}
+
+	struct disk_map key = {
+		.cookie = DISK_MAP_COOKIE,
+		.version = DISK_MAP_VERSION,
+		.count = 0,
+		.uuid = footer.uuid,
+		.mtime_sec = st.st_mtim.tv_sec,
+		.mtime_nsec = st.st_mtim.tv_nsec,
+		.size = st.st_size,
+		.extents = NULL,
+	};
+	char mappath[strlen(vhdfile) + 5];
+	sprintf(mappath, "%s.map", vhdfile);
+
+	struct disk_map *map = load_disk_map(mappath, &key);
+	if (map) {
+		close(fd);
+		return map;
+	}
+
+	map = malloc(sizeof(*map));
+	*map = key;
+	scan_disk_map(fd, (st.st_size - 512) / 512 * 512, map);
+	close(fd);
+	save_disk_map(mappath, map);
+	return map;
+}
+
+void free_disk_map(struct disk_map *map)
+{
+	if (map) {
+		free(map->extents);
+		free(map);
+	}
+}
+
+/*
+ * Description:
+ *     apply records of a complete log to fd and make them durable,
+ *     return number of records or -1 if log is torn or corrupt
+ */
+static int apply_journal(int fd, const uint8_t *log, uint64_t len,
+			 uint64_t data_bytes)
+{
+	struct journal_header header;
+	if (len < sizeof(header)) {
+		return -1;
+	}
+	memcpy(&header, log, sizeof(header));
+	if (header.cookie != JOURNAL_COOKIE ||
+	    header.version != JOURNAL_VERSION ||
+	    header.bytes > len - sizeof(header)) {
+		return -1;
+	}
+	uint32_t checksum = header.checksum;
+	header.checksum = 0;
+	uint32_t crc = cal_crc32(0, &header, sizeof(header));
+	crc = cal_crc32(crc, log + sizeof(header), header.bytes);
+	if (crc != checksum) {
+		return -1;
+	}
+
+	/* validate every record before touching vhdfile */
+	const uint8_t *end = log + sizeof(header) + header.bytes;
+	const uint8_t *p = log + sizeof(header);
+	for (uint32_t i = 0; i < header.count; i++) {
+		struct journal_record record;
+		if (end - p < (ssize_t)sizeof(record)) {
+			return -1;
+		}
+		memcpy(&record, p, sizeof(record));
+		p += sizeof(record);
+		if (end - p < record.len ||
+		    record.offset + record.len > data_bytes) {
+			return -1;
+		}
+		p += record.len;
+	}
+
+	p = log + sizeof(header);
+	for (uint32_t i = 0; i < header.count; i++) {
+		struct journal_record record;
+		memcpy(&record, p, sizeof(record));
+		p += sizeof(record);
+		if (pwrite(fd, p, record.len, record.offset) != record.len) {
+			fprintf(stderr, "Error occurs when applying journal\n");
+			exit(1);
+		}
+		p += record.len;
+	}
+	if (fdatasync(fd) != 0) {
+		fprintf(stderr, "Error occurs when syncing file\n");
+		exit(1);
+	}
+	return header.count;
+}
+
+/*
+ * Description:
+ *     fsync directory of path, so creating or removing path is durable
+ */
+static void sync_dir(const char *path)
+{
+	char dir[strlen(path) + 1];
+	strcpy(dir, path);
+	int fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+	if (fd == -1 || fsync(fd) != 0) {
+		fprintf(stderr, "Error occurs when syncing directory of %s\n",
+			path);
+		exit(1);
+	}
+	close(fd);
+}
+
+/*
+ * Description:
+ *     replay [vhdfile].wal left by an interrupted batch, a torn log
+ *     (crash before its fsync) is discarded since vhdfile was not touched.
+ *     Return number of replayed records.
+ */
+static int replay_journal_fd(int fd, uint64_t data_bytes, const char *logpath)
+{
+	int log_fd = open(logpath, O_RDWR);
+	if (log_fd == -1) {
+		return 0;
+	}
+	struct stat st;
+	int replayed = 0;
+	if (fstat(log_fd, &st) == 0 && st.st_size > 0) {
+		uint8_t *log = malloc(st.st_size);
+		if (pread(log_fd, log, st.st_size, 0) == st.st_size) {
+			replayed = apply_journal(fd, log, st.st_size,
+						 data_bytes);
+		}
+		free(log);
+	}
+	close(log_fd);
+	/* log must be gone for good before vhdfile takes other writes */
+	unlink(logpath);
+	sync_dir(logpath);
+	return replayed > 0 ? replayed : 0;
+}
+
+/*
+ * Description:
+ *     open fixed vhdfile for journaled writes, replay pending log first.
+ *     Records hold file offsets, which are LBAs only on fixed disks.
+ */
+struct journal *journal_open(const char *vhdfile)
+{
+	int fd = open(vhdfile, O_RDWR);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		fprintf(stderr, "Cannot open file %s\n", vhdfile);
+		exit(1);
+	}
+	struct footer footer;
+	if (st.st_size < 512 ||
+	    pread(fd, &footer, footer_size, st.st_size - 512) !=
+		    (ssize_t)footer_size ||
+	    footer.cookie != DEFAULT_COOKIE) {
+		fprintf(stderr, "File %s is not a VHD\n", vhdfile);
+		exit(1);
+	}
+	if (footer.disk_type != DISK_TYPE_FIXED_HARD_DISK) {
+		fprintf(stderr, "Journal supports fixed disk only, %s is not\n",
+			vhdfile);
+		exit(1);
+	}
+
+	struct journal *journal = malloc(sizeof(*journal));
+	journal->fd = fd;
+	journal->data_bytes = st.st_size - 512; /* never touch footer */
+	journal->logpath = malloc(strlen(vhdfile) + 5);
+	sprintf(journal->logpath, "%s.wal", vhdfile);
+	replay_journal_fd(fd, journal->data_bytes, journal->logpath);
+
+	journal->log_fd =
+		open(journal->logpath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (journal->log_fd == -1) {
+		fprintf(stderr, "Cannot open file %s\n", journal->logpath);
+		exit(1);
+	}
+	/* a batch applied later must not lose its log to a crash */
+	sync_dir(journal->logpath);
+	journal->cap = 1024 * 1024;
+	journal->buffer = malloc(journal->cap);
+	journal->len = sizeof(struct journal_header);
+	pthread_mutex_init(&journal->lock, NULL);
+	return journal;
+}
+
+/*
+ * Description:
+ *     add a write of len bytes at LBA into pending batch,
+ *     nothing reaches disk until journal_commit
+ */
+void journal_write(struct journal *journal, uint32_t LBA, const void *buffer,
+		   uint32_t len)
+{
+	uint64_t offset = (uint64_t)LBA * 512;
+	if (offset + len > journal->data_bytes) {
+		fprintf(stderr, "LBA %u + %u Bytes out of disk size\n", LBA,
+			len);
+		exit(1);
+	}
+	pthread_mutex_lock(&journal->lock);
+	uint64_t need = journal->len + sizeof(struct journal_record) + len;
+	if (need > journal->cap) {
+		while (journal->cap < need) {
+			journal->cap *= 2;
+		}
+		journal->buffer = realloc(journal->buffer, journal->cap);
+	}
+	struct journal_record record = {
+		.offset = offset,
+		.len = len,
+		.reserved = 0,
+	};
+	memcpy(journal->buffer + journal->len, &record, sizeof(record));
+	memcpy(journal->buffer + journal->len + sizeof(record), buffer, len);
+	journal->len = need;
+	pthread_mutex_unlock(&journal->lock);
+}
+
+/*
+ * Description:
+ *     add content of binfile at LBA into pending batch
+ */
+void journal_write_bin(struct journal *journal, const char *binfile,
+		       uint32_t LBA)
+{
+	FILE *fp = fopen(binfile, "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "Cannot open file %s\n", binfile);
+		exit(1);
+	}
+	int input_size = get_filesize(binfile);
+	uint8_t *buffer = malloc(input_size + 1);
+	read_block(buffer, input_size, fp);
+	fclose(fp);
+	journal_write(journal, LBA, buffer, input_size);
+	free(buffer);
+}
+
+/*
+ * Description:
+ *     group commit: log whole batch with one write and one fsync, then
+ *     apply it to vhdfile. After a crash the batch is either fully
+ *     replayed on next open or not applied at all.
+ */
+void journal_commit(struct journal *journal)
+{
+	pthread_mutex_lock(&journal->lock);
+	if (journal->len == sizeof(struct journal_header)) {
+		pthread_mutex_unlock(&journal->lock);
+		return;
+	}
+	struct journal_header header = {
+		.cookie = JOURNAL_COOKIE,
+		.version = JOURNAL_VERSION,
+		.count = 0,
+		.bytes = journal->len - sizeof(header),
+		.checksum = 0,
+		.reserved = 0,
+	};
+	for (uint64_t p = sizeof(header); p < journal->len;) {
+		struct journal_record record;
+		memcpy(&record, journal->buffer + p, sizeof(record));
+		p += sizeof(record) + record.len;
+		header.count++;
+	}
+	uint32_t crc = cal_crc32(0, &header, sizeof(header));
+	header.checksum = cal_crc32(crc, journal->buffer + sizeof(header),
+				    header.bytes);
+	memcpy(journal->buffer, &header, sizeof(header));
+
+	if (pwrite(journal->log_fd, journal->buffer, journal->len, 0) !=
+		    (ssize_t)journal->len ||
+	    fdatasync(journal->log_fd) != 0) {
+		fprintf(stderr, "Error occurs when writing journal\n");
+		exit(1);
+	}
+	apply_journal(journal->fd, journal->buffer, journal->len,
+		      journal->data_bytes);
+	/*
+	 * batch is durable in vhdfile now, empty log must be durable too
+	 * before vhdfile takes other writes, or a crash could bring the old
+	 * batch back and replay it over newer data
+	 */
+	if (ftruncate(journal->log_fd, 0) != 0 ||
+	    fsync(journal->log_fd) != 0) {
+		fprintf(stderr, "Error occurs when truncating journal\n");
+		exit(1);
+	}
+	journal->len = sizeof(struct journal_header);
+	pthread_mutex_unlock(&journal->lock);
+}
+
+/*
+ * Description:
+ *     commit pending batch, release journal and remove its log
+ */
+void journal_close(struct journal *journal)
+{
+	journal_commit(journal);
+	close(journal->log_fd);
+	unlink(journal->logpath);
+	sync_dir(journal->logpath);
+	close(journal->fd);
+	free(journal->logpath);
+	free(journal->buffer);
+	pthread_mutex_destroy(&journal->lock);
+	free(journal);
+}
+
+/*
+ * Description:
+ *     replay pending log of vhdfile if any, return number of records
+ */
+int journal_replay(const char *vhdfile)
+{
+	char logpath[strlen(vhdfile) + 5];
+	sprintf(logpath, "%s.wal", vhdfile);
+	if (access(logpath, F_OK) == -1) {
+		return 0;
+	}
+	int fd = open(vhdfile, O_RDWR);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1 || st.st_size < 512) {
+		fprintf(stderr, "Cannot open file %s\n", vhdfile);
+		exit(1);
+	}
+	int replayed = replay_journal_fd(fd, st.st_size - 512, logpath);
+	close(fd);
+	return replayed;
+}
+
+/*
+ * Description:
+ *     load dynamic header and BAT of handle
+ */
+static void load_dynamic_disk(struct vhd_handle *handle, const char *vhdfile,
+			      uint64_t filesize)
+{
+	uint64_t header_offset = bswap_64(handle->footer.data_offset);
+	if (header_offset > filesize - 512 ||
+	    filesize - 512 - header_offset < sizeof(handle->header) ||
+	    pread(handle->fd, &handle->header, sizeof(handle->header),
+		  header_offset) != sizeof(handle->header) ||
+	    handle->header.cookie != DYNAMIC_HEADER_COOKIE) {
+		fprintf(stderr, "File %s has no dynamic header\n", vhdfile);
+		exit(1);
+	}
+	handle->table_offset = bswap_64(handle->header.table_offset);
+	handle->max_table_entries =
+		bswap_32(handle->header.max_table_entries);
+	handle->block_size = bswap_32(handle->header.block_size);
+	if (handle->block_size < 512 ||
+	    (handle->block_size & (handle->block_size - 1)) != 0) {
+		fprintf(stderr, "File %s block size illegal\n", vhdfile);
+		exit(1);
+	}
+	handle->bitmap_bytes =
+		((handle->block_size / 512 / 8) + 511) / 512 * 512;
+	handle->data_end = filesize - 512;
+
+	/* BAT must lie inside file and cover the whole virtual disk */
+	uint64_t table_bytes =
+		(uint64_t)handle->max_table_entries * sizeof(uint32_t);
+	if (handle->table_offset % 512 != 0 ||
+	    handle->table_offset > filesize - 512 ||
+	    filesize - 512 - handle->table_offset < table_bytes) {
+		fprintf(stderr, "File %s BAT out of file\n", vhdfile);
+		exit(1);
+	}
+	if (handle->sectors > (uint64_t)handle->max_table_entries *
+				      (handle->block_size / 512)) {
+		fprintf(stderr, "File %s BAT too small for disk size\n",
+			vhdfile);
+		exit(1);
+	}
+
+	handle->bat = malloc(table_bytes + 1);
+	if (pread(handle->fd, handle->bat, table_bytes,
+		  handle->table_offset) != (ssize_t)table_bytes) {
+		fprintf(stderr, "Cannot read BAT of %s\n", vhdfile);
+		exit(1);
+	}
+	/*
+	 * same rule as check_dynamic_disk: a block must lie between BAT and
+	 * footer, or writes through it would overwrite metadata
+	 */
+	uint64_t block_sectors = (handle->bitmap_bytes + handle->block_size) /
+				 512;
+	uint64_t first_sector = (handle->table_offset + table_bytes + 511) / 512;
+	uint64_t last_sector = (filesize - 512) / 512;
+	for (uint32_t i = 0; i < handle->max_table_entries; i++) {
+		handle->bat[i] = bswap_32(handle->bat[i]);
+		if (handle->bat[i] != BAT_ENTRY_UNUSED &&
+		    (handle->bat[i] < first_sector ||
+		     handle->bat[i] + block_sectors > last_sector)) {
+			fprintf(stderr,
+				"File %s block %u at sector %u out of data "
+				"area\n",
+				vhdfile, i, handle->bat[i]);
+			exit(1);
+		}
+	}
+	handle->block_locks =
+		malloc((handle->max_table_entries + 1) * sizeof(pthread_mutex_t));
+	for (uint32_t i = 0; i < handle->max_table_entries; i++) {
+		pthread_mutex_init(&handle->block_locks[i], NULL);
+	}
+	pthread_mutex_init(&handle->alloc_mutex, NULL);
+}
+
+/*
+ * Description:
+ *     read a VHDX header, return 1 if signature and crc32c are valid
+ */
+static int read_vhdx_header(int fd, uint64_t offset, struct vhdx_header *header)
+{
+	uint8_t buf[VHDX_HEADER_BYTES];
+	if (pread(fd, buf, sizeof(buf), offset) != sizeof(buf)) {
+		return 0;
+	}
+	memcpy(header, buf, sizeof(*header));
+	memset(buf + offsetof(struct vhdx_header, checksum), 0,
+	       sizeof(header->checksum));
+	return header->signature == VHDX_HEADER_SIGNATURE &&
+	       header->checksum == cal_crc32c(0, buf, sizeof(buf));
+}
+
+/*
+ * Description:
+ *     read a VHDX region table into buf, return 1 if valid
+ */
+static int read_vhdx_region_table(int fd, uint64_t offset, uint8_t *buf)
+{
+	if (pread(fd, buf, VHDX_REGION_TABLE_BYTES, offset) !=
+	    VHDX_REGION_TABLE_BYTES) {
+		return 0;
+	}
+	struct vhdx_region_table_header header;
+	memcpy(&header, buf, sizeof(header));
+	memset(buf + offsetof(struct vhdx_region_table_header, checksum), 0,
+	       sizeof(header.checksum));
+	return header.signature == VHDX_REGION_SIGNATURE &&
+	       header.entry_count <= 2047 &&
+	       header.checksum ==
+		       cal_crc32c(0, buf, VHDX_REGION_TABLE_BYTES);
+}
+
+/*
+ * Description:
+ *     find metadata item by GUID, copy at most len bytes of it into value,
+ *     return 1 if found
+ */
+static int find_vhdx_metadata(const uint8_t *metadata, uint32_t metadata_len,
+			      const struct uuid *item_id, void *value,
+			      uint32_t len)
+{
+	struct vhdx_metadata_header header;
+	memcpy(&header, metadata, sizeof(header));
+	for (uint16_t i = 0; i < header.entry_count; i++) {
+		struct vhdx_metadata_entry entry;
+		uint64_t pos = sizeof(header) + (uint64_t)i * sizeof(entry);
+		if (pos + sizeof(entry) > metadata_len) {
+			return 0;
+		}
+		memcpy(&entry, metadata + pos, sizeof(entry));
+		if (memcmp(&entry.item_id, item_id, sizeof(*item_id)) != 0) {
+			continue;
+		}
+		if (entry.length < len ||
+		    (uint64_t)entry.offset + len > metadata_len) {
+			return 0;
+		}
+		memcpy(value, metadata + entry.offset, len);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Description:
+ *     parse headers, region table, metadata and BAT of a VHDX
+ */
+static void load_vhdx(struct vhd_handle *handle, const char *vhdfile,
+		      uint64_t filesize)
+{
+	/* current header is the valid one with greater sequence number */
+	struct vhdx_header header_1, header_2;
+	int valid_1 = read_vhdx_header(handle->fd, VHDX_HEADER_1_OFFSET,
+				       &header_1);
+	int valid_2 = read_vhdx_header(handle->fd, VHDX_HEADER_2_OFFSET,
+				       &header_2);
+	if (!valid_1 && !valid_2) {
+		fprintf(stderr, "VHDX %s has no valid header\n", vhdfile);
+		exit(1);
+	}
+	handle->vhdx_header = (valid_1 && (!valid_2 ||
+					   header_1.sequence_number >=
+						   header_2.sequence_number)) ?
+				      header_1 :
+				      header_2;
+	static const struct uuid zero_guid = { 0 };
+	if (memcmp(&handle->vhdx_header.log_guid, &zero_guid,
+		   sizeof(zero_guid)) != 0) {
+		fprintf(stderr, "VHDX %s has a log to replay, not supported\n",
+			vhdfile);
+		exit(1);
+	}
+
+	/* region table, second copy follows the first one */
+	uint8_t *table = malloc(VHDX_REGION_TABLE_BYTES);
+	if (!read_vhdx_region_table(handle->fd, VHDX_REGION_TABLE_OFFSET,
+				    table) &&
+	    !read_vhdx_region_table(handle->fd,
+				    VHDX_REGION_TABLE_OFFSET +
+					    VHDX_REGION_TABLE_BYTES,
+				    table)) {
+		fprintf(stderr, "VHDX %s has no valid region table\n",
+			vhdfile);
+		exit(1);
+	}
+	struct vhdx_region_table_header table_header;
+	memcpy(&table_header, table, sizeof(table_header));
+	struct vhdx_region_entry bat_region = { 0 }, metadata_region = { 0 };
+	for (uint32_t i = 0; i < table_header.entry_count; i++) {
+		struct vhdx_region_entry entry;
+		memcpy(&entry, table + sizeof(table_header) + i * sizeof(entry),
+		       sizeof(entry));
+		if (memcmp(&entry.guid, &vhdx_bat_guid, sizeof(entry.guid)) ==
+		    0) {
+			bat_region = entry;
+		} else if (memcmp(&entry.guid, &vhdx_metadata_guid,
+				  sizeof(entry.guid)) == 0) {
+			metadata_region = entry;
+		} else if (entry.required) {
+			fprintf(stderr, "VHDX %s requires unknown region\n",
+				vhdfile);
+			exit(1);
+		}
+	}
+	free(table);
+	if (bat_region.length == 0 || metadata_region.length == 0 ||
+	    bat_region.file_offset + bat_region.length > filesize ||
+	    metadata_region.file_offset + metadata_region.length > filesize) {
+		fprintf(stderr, "VHDX %s region table illegal\n", vhdfile);
+		exit(1);
+	}
+
+	/* metadata */
+	uint8_t *metadata = malloc(metadata_region.length);
+	pread_full(handle->fd, metadata, metadata_region.length,
+		   metadata_region.file_offset);
+	struct vhdx_metadata_header metadata_header;
+	memcpy(&metadata_header, metadata, sizeof(metadata_header));
+	uint32_t file_parameters[2];
+	uint64_t virtual_size;
+	uint32_t logical_sector_size, physical_sector_size;
+	if (metadata_header.signature != VHDX_METADATA_SIGNATURE ||
+	    !find_vhdx_metadata(metadata, metadata_region.length,
+				&vhdx_file_parameters_guid, file_parameters,
+				sizeof(file_parameters)) ||
+	    !find_vhdx_metadata(metadata, metadata_region.length,
+				&vhdx_virtual_disk_size_guid, &virtual_size,
+				sizeof(virtual_size)) ||
+	    !find_vhdx_metadata(metadata, metadata_region.length,
+				&vhdx_logical_sector_size_guid,
+				&logical_sector_size,
+				sizeof(logical_sector_size)) ||
+	    !find_vhdx_metadata(metadata, metadata_region.length,
+				&vhdx_physical_sector_size_guid,
+				&physical_sector_size,
+				sizeof(physical_sector_size))) {
+		fprintf(stderr, "VHDX %s metadata illegal\n", vhdfile);
+		exit(1);
+	}
+	free(metadata);
+
+	handle->block_size = file_parameters[0];
+	handle->file_parameters_flags = file_parameters[1];
+	handle->sector_size = logical_sector_size;
+	handle->physical_sector_size = physical_sector_size;
+	if (handle->file_parameters_flags & VHDX_FILE_PARAMETERS_HAS_PARENT) {
+		fprintf(stderr, "Differencing VHDX %s not supported\n",
+			vhdfile);
+		exit(1);
+	}
+	if ((logical_sector_size != 512 && logical_sector_size != 4096) ||
+	    handle->block_size < 1024 * 1024 ||
+	    (handle->block_size & (handle->block_size - 1)) != 0 ||
+	    virtual_size % logical_sector_size != 0) {
+		fprintf(stderr, "VHDX %s metadata illegal\n", vhdfile);
+		exit(1);
+	}
+	handle->sectors = virtual_size / logical_sector_size;
+
+	/* a sector bitmap entry follows every chunk_ratio payload entries */
+	handle->chunk_ratio = ((uint64_t)1 << 23) * logical_sector_size /
+			      handle->block_size;
+	uint64_t blocks = (virtual_size + handle->block_size - 1) /
+			  handle->block_size;
+	uint64_t entries = blocks ? blocks + (blocks - 1) / handle->chunk_ratio :
+				    0;
+	handle->vhdx_bat_entries = bat_region.length / sizeof(uint64_t);
+	if (entries > handle->vhdx_bat_entries) {
+		fprintf(stderr, "VHDX %s BAT too small\n", vhdfile);
+		exit(1);
+	}
+	handle->vhdx_bat = malloc(bat_region.length);
+	pread_full(handle->fd, handle->vhdx_bat, bat_region.length,
+		   bat_region.file_offset);
+}
+
+/*
+ * Description:
+ *     open fixed or dynamic vhdfile, the handle can be shared by threads.
+ *     Pending journal of vhdfile is replayed first.
+ */
+struct vhd_handle *vhd_open(const char *vhdfile, int writable)
+{
+	journal_replay(vhdfile);
+
+	struct vhd_handle *handle = calloc(1, sizeof(*handle));
+	handle->fd = open(vhdfile, writable ? O_RDWR : O_RDONLY);
+	handle->writable = writable;
+	handle->sector_size = 512;
+	struct stat st;
+	if (handle->fd == -1 || fstat(handle->fd, &st) == -1) {
+		fprintf(stderr, "Cannot open file %s\n", vhdfile);
+		exit(1);
+	}
+	pthread_mutex_init(&handle->range_mutex, NULL);
+	pthread_cond_init(&handle->range_cond, NULL);
+
+	uint64_t signature = 0;
+	if (pread(handle->fd, &signature, sizeof(signature), 0) ==
+		    sizeof(signature) &&
+	    signature == VHDX_FILE_SIGNATURE) {
+		if (writable) {
+			fprintf(stderr, "VHDX %s can only be read\n", vhdfile);
+			exit(1);
+		}
+		handle->format = DISK_FORMAT_VHDX;
+		load_vhdx(handle, vhdfile, st.st_size);
+		return handle;
+	}
+
+	handle->format = DISK_FORMAT_VHD;
+	if (st.st_size < 512 ||
+	    pread(handle->fd, &handle->footer, footer_size,
+		  st.st_size - 512) != (ssize_t)footer_size ||
+	    handle->footer.cookie != DEFAULT_COOKIE) {
+		fprintf(stderr, "File %s is not a VHD\n", vhdfile);
+		exit(1);
+	}
+
+	handle->disk_type = handle->footer.disk_type;
+	if (handle->disk_type == DISK_TYPE_FIXED_HARD_DISK) {
+		/* data area is everything but footer */
+		handle->sectors = (st.st_size - 512) / 512;
+	} else if (handle->disk_type == DISK_TYPE_DYNAMIC_HARD_DISK) {
+		handle->sectors = bswap_64(handle->footer.current_size) / 512;
+		load_dynamic_disk(handle, vhdfile, st.st_size);
+	} else {
+		fprintf(stderr, "File %s disk type not supported\n", vhdfile);
+		exit(1);
+	}
+	return handle;
+}
+
+void vhd_close(struct vhd_handle *handle)
+{
+	if (handle->format == DISK_FORMAT_VHDX) {
+		free(handle->vhdx_bat);
+	} else if (handle->disk_type == DISK_TYPE_DYNAMIC_HARD_DISK) {
+		for (uint32_t i = 0; i < handle->max_table_entries; i++) {
+			pthread_mutex_destroy(&handle->block_locks[i]);
+		}
+		pthread_mutex_destroy(&handle->alloc_mutex);
+		free(handle->block_locks);
+		free(handle->bat);
+	}
+	pthread_mutex_destroy(&handle->range_mutex);
+	pthread_cond_destroy(&handle->range_cond);
+	close(handle->fd);
+	free(handle);
+}
+
+/*
+ * Description:
+ *     lock LBAs [LBA, LBA + count), blocks while an overlapping range is
+ *     held and either of them is a write. Return token for unlock.
+ */
+struct range_lock *vhd_lock_range(struct vhd_handle *handle, uint64_t LBA,
+				  uint64_t count, int write)
+{
+	struct range_lock *lock = malloc(sizeof(*lock));
+	lock->start = LBA;
+	lock->end = LBA + count;
+	lock->write = write;
+
+	pthread_mutex_lock(&handle->range_mutex);
+	for (;;) {
+		struct range_lock *held = handle->ranges;
+		while (held && !(held->start < lock->end &&
+				 lock->start < held->end &&
+				 (held->write || write))) {
+			held = held->next;
+		}
+		if (held == NULL) {
+			break;
+		}
+		pthread_cond_wait(&handle->range_cond, &handle->range_mutex);
+	}
+	lock->next = handle->ranges;
+	handle->ranges = lock;
+	pthread_mutex_unlock(&handle->range_mutex);
+	return lock;
+}
+
+void vhd_unlock_range(struct vhd_handle *handle, struct range_lock *lock)
+{
+	pthread_mutex_lock(&handle->range_mutex);
+	struct range_lock **p = &handle->ranges;
+	while (*p != lock) {
+		p = &(*p)->next;
+	}
+	*p = lock->next;
+	pthread_cond_broadcast(&handle->range_cond);
+	pthread_mutex_unlock(&handle->range_mutex);
+	free(lock);
+}
+
+/*
+ * Description:
+ *     lock one block of dynamic disk, block_locks exists only for
+ *     dynamic handles
+ */
+static void vhd_lock_block(struct vhd_handle *handle, uint32_t block)
+{
+	pthread_mutex_lock(&handle->block_locks[block]);
+}
+
+static void vhd_unlock_block(struct vhd_handle *handle, uint32_t block)
+{
+	pthread_mutex_unlock(&handle->block_locks[block]);
+}
+
+static void pread_full(int fd, void *buffer, size_t len, uint64_t offset)
+{
+	if (pread(fd, buffer, len, offset) != (ssize_t)len) {
+		fprintf(stderr, "Error occurs when reading buffer from file\n");
+		exit(1);
+	}
+}
+
+static void pwrite_full(int fd, const void *buffer, size_t len,
+			uint64_t offset)
+{
+	if (pwrite(fd, buffer, len, offset) != (ssize_t)len) {
+		fprintf(stderr, "Error occurs when writing buffer into file\n");
+		exit(1);
+	}
+}
+
+/*
+ * Description:
+ *     read count LBAs of one dynamic block, starting at sector of block.
+ *     Unallocated blocks and sectors with clear bitmap bit read as zero.
+ */
+static void read_dynamic_block(struct vhd_handle *handle, uint32_t block,
+			       uint32_t sector, uint32_t count, uint8_t *buffer)
+{
+	uint32_t entry = __atomic_load_n(&handle->bat[block], __ATOMIC_ACQUIRE);
+	if (entry == BAT_ENTRY_UNUSED) {
+		memset(buffer, 0, (size_t)count * 512);
+		return;
+	}
+	uint64_t block_offset = (uint64_t)entry * 512;
+	pread_full(handle->fd, buffer, (size_t)count * 512,
+		   block_offset + handle->bitmap_bytes + (uint64_t)sector * 512);
+
+	/* bitmap: MSB of byte 0 is sector 0 */
+	uint32_t first = sector / 8, last = (sector + count - 1) / 8;
+	uint8_t bitmap[last - first + 1];
+	pread_full(handle->fd, bitmap, sizeof(bitmap), block_offset + first);
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t s = sector + i;
+		if (!(bitmap[s / 8 - first] & (0x80 >> (s % 8)))) {
+			memset(buffer + (size_t)i * 512, 0, 512);
+		}
+	}
+}
+
+/*
+ * Description:
+ *     append a new block at footer position, move footer behind it and
+ *     point BAT entry to it. Caller holds the block lock.
+ */
+static uint32_t alloc_dynamic_block(struct vhd_handle *handle, uint32_t block)
+{
+	pthread_mutex_lock(&handle->alloc_mutex);
+	uint64_t block_offset = handle->data_end;
+	uint64_t new_end = block_offset + handle->bitmap_bytes +
+			   handle->block_size;
+
+	/*
+	 * footer goes to new end first, so the file always ends with a
+	 * footer; the old one is then overwritten by the zeroed bitmap
+	 */
+	uint8_t footer_buf[512] = { 0 };
+	memcpy(footer_buf, &handle->footer, footer_size);
+	pwrite_full(handle->fd, footer_buf, 512, new_end);
+	uint8_t *bitmap = calloc(1, handle->bitmap_bytes);
+	pwrite_full(handle->fd, bitmap, handle->bitmap_bytes, block_offset);
+	free(bitmap);
+	handle->data_end = new_end;
+	pthread_mutex_unlock(&handle->alloc_mutex);
+
+	uint32_t entry = block_offset / 512;
+	uint32_t entry_be = bswap_32(entry);
+	pwrite_full(handle->fd, &entry_be, sizeof(entry_be),
+		    handle->table_offset + (uint64_t)block * sizeof(uint32_t));
+	__atomic_store_n(&handle->bat[block], entry, __ATOMIC_RELEASE);
+	return entry;
+}
+
+/*
+ * Description:
+ *     write count LBAs into one dynamic block, allocate block if needed
+ *     and set bitmap bits of written sectors
+ */
+static void write_dynamic_block(struct vhd_handle *handle, uint32_t block,
+				uint32_t sector, uint32_t count,
+				const uint8_t *buffer)
+{
+	vhd_lock_block(handle, block);
+	uint32_t entry = handle->bat[block];
+	if (entry == BAT_ENTRY_UNUSED) {
+		entry = alloc_dynamic_block(handle, block);
+	}
+	uint64_t block_offset = (uint64_t)entry * 512;
+	pwrite_full(handle->fd, buffer, (size_t)count * 512,
+		    block_offset + handle->bitmap_bytes + (uint64_t)sector * 512);
+
+	uint32_t first = sector / 8, last = (sector + count - 1) / 8;
+	uint8_t bitmap[last - first + 1];
+	pread_full(handle->fd, bitmap, sizeof(bitmap), block_offset + first);
+	for (uint32_t s = sector; s < sector + count; s++) {
+		bitmap[s / 8 - first] |= 0x80 >> (s % 8);
+	}
+	pwrite_full(handle->fd, bitmap, sizeof(bitmap), block_offset + first);
+	vhd_unlock_block(handle, block);
+}
+
+/*
+ * Description:
+ *     read len bytes of VHDX virtual disk at offset. Each run inside a
+ *     payload block is one pread, however large the block is.
+ */
+static void read_vhdx(struct vhd_handle *handle, uint64_t offset,
+		      uint64_t len, uint8_t *buffer)
+{
+	while (len > 0) {
+		uint64_t block = offset / handle->block_size;
+		uint64_t within = offset % handle->block_size;
+		uint64_t n = handle->block_size - within < len ?
+				     handle->block_size - within :
+				     len;
+		uint64_t entry =
+			handle->vhdx_bat[block + block / handle->chunk_ratio];
+		uint64_t state = entry & VHDX_BAT_STATE_MASK;
+		if (state == VHDX_PAYLOAD_BLOCK_FULLY_PRESENT ||
+		    state == VHDX_PAYLOAD_BLOCK_PARTIALLY_PRESENT) {
+			pread_full(handle->fd, buffer, n,
+				   (entry & VHDX_BAT_OFFSET_MASK) + within);
+		} else {
+			/* not present, zero, unmapped and undefined */
+			memset(buffer, 0, n);
+		}
+		offset += n;
+		len -= n;
+		buffer += n;
+	}
+}
+
+/*
+ * Description:
+ *     read count LBAs starting at LBA into buffer
+ */
+void vhd_read_sectors(struct vhd_handle *handle, uint64_t LBA, uint64_t count,
+		      void *buffer)
+{
+	if (LBA + count > handle->sectors) {
+		fprintf(stderr, "LBA %lu + %lu out of range: 0 - %lu\n", LBA,
+			count, handle->sectors - 1);
+		exit(1);
+	}
+	struct range_lock *lock = vhd_lock_range(handle, LBA, count, 0);
+	if (handle->format == DISK_FORMAT_VHDX) {
+		read_vhdx(handle, LBA * handle->sector_size,
+			  count * handle->sector_size, buffer);
+	} else if (handle->disk_type == DISK_TYPE_FIXED_HARD_DISK) {
+		pread_full(handle->fd, buffer, count * 512, LBA * 512);
+	} else {
+		uint32_t spb = handle->block_size / 512;
+		uint8_t *p = buffer;
+		while (count > 0) {
+			uint32_t sector = LBA % spb;
+			uint32_t n = spb - sector < count ? spb - sector : count;
+			read_dynamic_block(handle, LBA / spb, sector, n, p);
+			LBA += n;
+			count -= n;
+			p += (size_t)n * 512;
+		}
+	}
+	vhd_unlock_range(handle, lock);
+}
+
+/*
+ * Description:
+ *     write count LBAs from buffer starting at LBA, footer is never
+ *     overwritten
+ */
+void vhd_write_sectors(struct vhd_handle *handle, uint64_t LBA, uint64_t count,
+		       const void *buffer)
+{
+	if (!handle->writable) {
+		fprintf(stderr, "Disk is opened read-only\n");
+		exit(1);
+	}
+	if (LBA + count > handle->sectors) {
+		fprintf(stderr, "LBA %lu + %lu out of range: 0 - %lu\n", LBA,
+			count, handle->sectors - 1);
+		exit(1);
+	}
+	struct range_lock *lock = vhd_lock_range(handle, LBA, count, 1);
+	if (handle->disk_type == DISK_TYPE_FIXED_HARD_DISK) {
+		pwrite_full(handle->fd, buffer, count * 512, LBA * 512);
+	} else {
+		uint32_t spb = handle->block_size / 512;
+		const uint8_t *p = buffer;
+		while (count > 0) {
+			uint32_t sector = LBA % spb;
+			uint32_t n = spb - sector < count ? spb - sector : count;
+			write_dynamic_block(handle, LBA / spb, sector, n, p);
+			LBA += n;
+			count -= n;
+			p += (size_t)n * 512;
+		}
+	}
+	vhd_unlock_range(handle, lock);
+}
+
+/*
+ * Description:
+ *     make [offset, offset + len) of file read as zero without changing
+ *     file size: punch a hole, else zero the range in place, else write
+ *     zeros if write_zeros is set. Return 1 if no data had to be written.
+ */
+static int discard_range(int fd, uint64_t offset, uint64_t len,
+			 int write_zeros)
+{
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+		      len) == 0 ||
+	    fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset,
+		      len) == 0) {
+		return 1;
+	}
+	if (!write_zeros) {
+		return 0;
+	}
+	uint8_t *zeros = calloc(1, CONVERT_CHUNK_BYTES);
+	while (len > 0) {
+		size_t piece = len < CONVERT_CHUNK_BYTES ? len :
+							   CONVERT_CHUNK_BYTES;
+		pwrite_full(fd, zeros, piece, offset);
+		offset += piece;
+		len -= piece;
+	}
+	free(zeros);
+	return 0;
+}
+
+/*
+ * Description:
+ *     discard count LBAs of one dynamic block. A fully covered block is
+ *     freed from BAT, a partly covered one gets its bitmap bits cleared.
+ */
+static void trim_dynamic_block(struct vhd_handle *handle, uint32_t block,
+			       uint32_t sector, uint32_t count)
+{
+	vhd_lock_block(handle, block);
+	uint32_t entry = handle->bat[block];
+	if (entry == BAT_ENTRY_UNUSED) {
+		vhd_unlock_block(handle, block);
+		return;
+	}
+	uint64_t block_offset = (uint64_t)entry * 512;
+
+	if (sector == 0 && count == handle->block_size / 512) {
+		uint32_t unused = BAT_ENTRY_UNUSED;
+		pwrite_full(handle->fd, &unused, sizeof(unused),
+			    handle->table_offset +
+				    (uint64_t)block * sizeof(uint32_t));
+		__atomic_store_n(&handle->bat[block], unused,
+				 __ATOMIC_RELEASE);
+		/* give space of unreferenced block back to filesystem */
+		discard_range(handle->fd, block_offset,
+			      handle->bitmap_bytes + handle->block_size, 0);
+	} else {
+		uint32_t first = sector / 8, last = (sector + count - 1) / 8;
+		uint8_t bitmap[last - first + 1];
+		pread_full(handle->fd, bitmap, sizeof(bitmap),
+			   block_offset + first);
+		for (uint32_t s = sector; s < sector + count; s++) {
+			bitmap[s / 8 - first] &= ~(0x80 >> (s % 8));
+		}
+		pwrite_full(handle->fd, bitmap, sizeof(bitmap),
+			    block_offset + first);
+		/* cleared bits already read as zero, only reclaim space */
+		discard_range(handle->fd,
+			      block_offset + handle->bitmap_bytes +
+				      (uint64_t)sector * 512,
+			      (uint64_t)count * 512, 0);
+	}
+	vhd_unlock_block(handle, block);
+}
+
+/*
+ * Description:
+ *     discard count LBAs starting at LBA, they read as zero afterwards.
+ *     Only metadata changes where the filesystem supports hole punching,
+ *     footer is never touched.
+ */
+void vhd_trim_sectors(struct vhd_handle *handle, uint64_t LBA, uint64_t count)
+{
+	if (!handle->writable) {
+		fprintf(stderr, "Disk is opened read-only\n");
+		exit(1);
+	}
+	if (LBA + count > handle->sectors) {
+		fprintf(stderr, "LBA %lu + %lu out of range: 0 - %lu\n", LBA,
+			count, handle->sectors - 1);
+		exit(1);
+	}
+	struct range_lock *lock = vhd_lock_range(handle, LBA, count, 1);
+	if (handle->disk_type == DISK_TYPE_FIXED_HARD_DISK) {
+		discard_range(handle->fd, LBA * 512, count * 512, 1);
+	} else {
+		uint32_t spb = handle->block_size / 512;
+		while (count > 0) {
+			uint32_t sector = LBA % spb;
+			uint32_t n = spb - sector < count ? spb - sector : count;
+			trim_dynamic_block(handle, LBA / spb, sector, n);
+			LBA += n;
+			count -= n;
+		}
+	}
+	vhd_unlock_range(handle, lock);
+}
+
+/*
+ * Description:
+ *     check if file starts with VHDX file identifier
+ */
+int is_vhdx(const char *filepath)
+{
+	int fd = open(filepath, O_RDONLY);
+	if (fd == -1) {
+		return 0;
+	}
+	uint64_t signature = 0;
+	ssize_t len = pread(fd, &signature, sizeof(signature), 0);
+	close(fd);
+	return len == sizeof(signature) && signature == VHDX_FILE_SIGNATURE;
+}
+
+/*
+ * Description:
+ *     print VHDX GUID in registry format, fields are little-endian
+ */
+static void print_guid(const char *name, const struct uuid *guid)
+{
+	printf("%s: %08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x\n", name,
+	       guid->f1, guid->f2, guid->f3, guid->f4[0], guid->f4[1],
+	       guid->f4[2], guid->f4[3], guid->f4[4], guid->f4[5],
+	       guid->f4[6], guid->f4[7]);
+}
+
+/*
+ * Description:
+ *     print VHDX header and metadata info
+ */
+void print_vhdx_info(const struct vhd_handle *handle)
+{
+	printf("file format: VHDX\n");
+	printf("version: %u\n", handle->vhdx_header.version);
+	printf("sequence number: %lu\n", handle->vhdx_header.sequence_number);
+	print_guid("data write guid", &handle->vhdx_header.data_write_guid);
+
+	/* virtual size */
+	printf("virtual size: ");
+	uint64_t size_B = handle->sectors * handle->sector_size;
+	uint64_t size_MB = size_B / (1024 * 1024), size_GB = size_MB / 1024;
+	if (size_GB > 0) {
+		printf("%lu GB\n", size_GB);
+	} else if (size_MB > 0) {
+		printf("%lu MB\n", size_MB);
+	} else {
+		printf("%lu B\n", size_B);
+	}
+
+	printf("block size: %u MB\n", handle->block_size / (1024 * 1024));
+	printf("logical sector size: %u\n", handle->sector_size);
+	printf("physical sector size: %u\n", handle->physical_sector_size);
+	printf("leave blocks allocated: %s\n",
+	       handle->file_parameters_flags &
+			       VHDX_FILE_PARAMETERS_LEAVE_BLOCKS_ALLOCATED ?
+		       "Yes" :
+		       "No");
+
+	/* allocated payload blocks */
+	uint64_t blocks = (handle->sectors * handle->sector_size +
+			   handle->block_size - 1) /
+			  handle->block_size;
+	uint64_t present = 0;
+	for (uint64_t b = 0; b < blocks; b++) {
+		uint64_t state = handle->vhdx_bat[b + b / handle->chunk_ratio] &
+				 VHDX_BAT_STATE_MASK;
+		present += state == VHDX_PAYLOAD_BLOCK_FULLY_PRESENT ||
+			   state == VHDX_PAYLOAD_BLOCK_PARTIALLY_PRESENT;
+	}
+	printf("allocated blocks: %lu / %lu\n", present, blocks);
+}
+
+struct convert_job {
+	struct vhd_handle *src;
+	struct disk_map *map; /* zero extents of fixed VHD source, or NULL */
+	int fd;
+	uint64_t bytes;
+	uint32_t nchunks;
+	uint32_t next; /* index of next chunk, taken atomically */
+};
+
+/*
+ * Description:
+ *     check if LBA range [LBA, LBA + count) lies in zero extents of map
+ */
+static int map_range_zero(const struct disk_map *map, uint64_t LBA,
+			  uint64_t count)
+{
+	/* extents are sorted and adjacent, find the one holding LBA */
+	uint32_t lo = 0, hi = map->count;
+	while (hi - lo > 1) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (map->extents[mid].startLBA <= LBA) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	for (uint32_t i = lo; i < map->count; i++) {
+		const struct extent *e = &map->extents[i];
+		if (!e->zero) {
+			return 0;
+		}
+		if ((uint64_t)e->startLBA + e->count >= LBA + count) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void *convert_worker(void *arg)
+{
+	struct convert_job *job = arg;
+	uint32_t ss = job->src->sector_size;
+	uint8_t *buf = malloc(CONVERT_CHUNK_BYTES);
+	uint32_t c;
+	while ((c = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+	       job->nchunks) {
+		uint64_t offset = (uint64_t)c * CONVERT_CHUNK_BYTES;
+		uint64_t len = job->bytes - offset < CONVERT_CHUNK_BYTES ?
+				       job->bytes - offset :
+				       CONVERT_CHUNK_BYTES;
+		/* target is created sparse, zero extents need no read */
+		if (job->map &&
+		    map_range_zero(job->map, offset / ss, len / ss)) {
+			continue;
+		}
+		vhd_read_sectors(job->src, offset / ss, len / ss, buf);
+		/* target is created sparse, zero chunks need no write */
+		if (!is_zero(buf, len)) {
+			pwrite_full(job->fd, buf, len, offset);
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Description:
+ *     convert srcfile (VHDX or VHD) into a new fixed vhdfile,
+ *     copying chunks in parallel. A fixed VHD source skips the zero
+ *     extents of its cached map. Target is limited by VHD format to
+ *     2040GB, and removed if conversion fails.
+ */
+void convert_to_fixed_disk(const char *srcfile, const char *vhdfile)
+{
+	struct vhd_handle *src = vhd_open(srcfile, 0);
+	uint64_t bytes = src->sectors * src->sector_size;
+	if (bytes > VHD_FORMAT_MAX_BYTES) {
+		fprintf(stderr, "Disk %s size %lu Bytes, larger than 2040GB\n",
+			srcfile, bytes);
+		exit(1);
+	}
+	if (access(vhdfile, F_OK) != -1) {
+		fprintf(stderr, "File %s already exixts\n", vhdfile);
+		exit(1);
+	}
+	/* never leave a partial copy behind */
+	set_pending_file(vhdfile);
+	create_fixed_disk_bytes(vhdfile, bytes);
+
+	struct disk_map *map = NULL;
+	if (src->format == DISK_FORMAT_VHD &&
+	    src->disk_type == DISK_TYPE_FIXED_HARD_DISK) {
+		map = map_disk(srcfile);
+	}
+	struct convert_job job = {
+		.src = src,
+		.map = map,
+		.fd = open(vhdfile, O_WRONLY),
+		.bytes = bytes,
+		.nchunks = (bytes + CONVERT_CHUNK_BYTES - 1) /
+			   CONVERT_CHUNK_BYTES,
+		.next = 0,
+	};
+	if (job.fd == -1) {
+		fprintf(stderr, "Cannot open file %s\n", vhdfile);
+		exit(1);
+	}
+	run_workers(convert_worker, &job, job.nchunks);
+	if (fsync(job.fd) != 0) {
+		fprintf(stderr, "Error occurs when syncing file\n");
+		exit(1);
+	}
+	close(job.fd);
+	set_pending_file(NULL);
+	free_disk_map(job.map);
+	vhd_close(src);
+}
+
+/*
+ * Description:
+ *     copy [offset, offset + len) from src_fd to dst_fd, by
+ *     copy_file_range (shares extents or copies in kernel where possible),
+ *     or by read/write if the filesystems do not support it
+ */
+static void copy_range(int src_fd, int dst_fd, uint64_t offset, uint64_t len)
+{
+	while (len > 0) {
+		loff_t src_off = offset, dst_off = offset;
+		ssize_t n = copy_file_range(src_fd, &src_off, dst_fd, &dst_off,
+					    len, 0);
+		if (n > 0) {
+			offset += n;
+			len -= n;
+			continue;
+		}
+		if (n == 0) {
+			break;
+		}
+		if (errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+		    errno != EOPNOTSUPP) {
+			fprintf(stderr, "Error occurs when copying file\n");
+			exit(1);
+		}
+		/* fallback */
+		uint8_t *buf = malloc(CONVERT_CHUNK_BYTES);
+		while (len > 0) {
+			size_t piece = len < CONVERT_CHUNK_BYTES ?
+					       len :
+					       CONVERT_CHUNK_BYTES;
+			pread_full(src_fd, buf, piece, offset);
+			pwrite_full(dst_fd, buf, piece, offset);
+			offset += piece;
+			len -= piece;
+		}
+		free(buf);
+	}
+}
+
+/*
+ * Description:
+ *     clone srcfile into new vhdfile. The whole file is reflinked
+ *     (FICLONE) when the filesystem allows, sharing all extents; else data
+ *     extents are copied and holes are kept. The clone gets a fresh uuid,
+ *     time stamp and checksum. It is built in a temp file, removed on
+ *     failure, and linked as vhdfile only when complete, so no second
+ *     image with the source uuid is ever left. Return 1 if reflinked,
+ *     0 if copied.
+ */
+int clone_disk(const char *srcfile, const char *vhdfile)
+{
+	/* check if file already exists */
+	if (access(vhdfile, F_OK) != -1) {
+		fprintf(stderr, "File %s already exixts\n", vhdfile);
+		exit(1);
+	}
+
+	int src_fd = open(srcfile, O_RDONLY);
+	struct stat st;
+	struct footer footer;
+	if (src_fd == -1 || fstat(src_fd, &st) == -1) {
+		fprintf(stderr, "Cannot open file %s\n", srcfile);
+		exit(1);
+	}
+	if (st.st_size < 512 ||
+	    pread(src_fd, &footer, footer_size, st.st_size - 512) !=
+		    (ssize_t)footer_size ||
+	    footer.cookie != DEFAULT_COOKIE) {
+		fprintf(stderr, "File %s is not a VHD\n", srcfile);
+		exit(1);
+	}
+
+	char tmppath[strlen(vhdfile) + 8];
+	sprintf(tmppath, "%s.XXXXXX", vhdfile);
+	int dst_fd = mkstemp(tmppath);
+	if (dst_fd == -1) {
+		fprintf(stderr, "Cannot open file %s\n", vhdfile);
+		exit(1);
+	}
+	set_pending_file(tmppath);
+	if (fchmod(dst_fd, 0644) != 0) {
+		fprintf(stderr, "Error occurs when creating file %s\n",
+			vhdfile);
+		exit(1);
+	}
+
+	int reflinked = ioctl(dst_fd, FICLONE, src_fd) == 0;
+	if (!reflinked) {
+		/* size first, so skipped holes stay holes */
+		if (ftruncate(dst_fd, st.st_size) != 0) {
+			fprintf(stderr, "Error occurs when creating file %s\n",
+				vhdfile);
+			exit(1);
+		}
+		uint64_t pos = 0, size = st.st_size;
+		while (pos < size) {
+			off_t data = lseek(src_fd, pos, SEEK_DATA);
+			if (data == -1 && errno == ENXIO) {
+				break; /* hole till end of file */
+			} else if (data == -1) {
+				data = pos; /* no hole info, copy everything */
+			}
+			off_t hole = lseek(src_fd, data, SEEK_HOLE);
+			if (hole == -1 || (uint64_t)hole > size) {
+				hole = size;
+			}
+			copy_range(src_fd, dst_fd, data, hole - data);
+			pos = hole;
+		}
+	}
+	close(src_fd);
+
+	/* fresh identity for the clone */
+	time_t seconds = time(NULL);
+	footer.time_stamp = bswap_32((uint32_t)(seconds - SECONDS_OFFSET));
+	uuid_generate((uint8_t *)&footer.uuid);
+	fillin_checksum(&footer);
+	uint8_t footer_buf[512] = { 0 };
+	memcpy(footer_buf, &footer, footer_size);
+	pwrite_full(dst_fd, footer_buf, 512, st.st_size - 512);
+	if (footer.disk_type == DISK_TYPE_DYNAMIC_HARD_DISK ||
+	    footer.disk_type == DISK_TYPE_DIFFERENCING_HARD_DISK) {
+		/* copy of footer at beginning */
+		pwrite_full(dst_fd, footer_buf, 512, 0);
+	}
+	if (fsync(dst_fd) != 0) {
+		fprintf(stderr, "Error occurs when syncing file\n");
+		exit(1);
+	}
+	close(dst_fd);
+	/* link never replaces, a vhdfile created meanwhile is kept */
+	if (link(tmppath, vhdfile) != 0) {
+		fprintf(stderr, "File %s already exixts\n", vhdfile);
+		exit(1);
+	}
+	unlink(tmppath);
+	set_pending_file(NULL);
+	sync_dir(vhdfile);
+
+	char uuid_str[37];
+	uuid_unparse((uint8_t *)&footer.uuid, uuid_str);
+	printf("New VHD uuid: %s\n", uuid_str);
+	return reflinked;
+}
+
+/*
+ * Description:
+ *     parse hex string into bytes, eg. "55aa" => {0x55, 0xaa},
+ *     bytes should hold strlen(hexStr) / 2 bytes, return number of bytes
+ */
+size_t parse_hex(const char *hexStr, uint8_t *bytes)
+{
+	if (hexStr[0] == '0' && (hexStr[1] == 'x' || hexStr[1] == 'X')) {
+		hexStr += 2;
+	}
+	size_t len = strlen(hexStr);
+	if (len == 0 || len % 2 != 0) {
+		fprintf(stderr, "Hex %s illegal\n", hexStr);
+		exit(1);
+	}
+	for (size_t i = 0; i < len; i += 2) {
+		if (!isxdigit(hexStr[i]) || !isxdigit(hexStr[i + 1])) {
+			fprintf(stderr, "Hex %s illegal\n", hexStr);
+			exit(1);
+		}
+		char byteStr[3] = { hexStr[i], hexStr[i + 1], '\0' };
+		bytes[i / 2] = strtoul(byteStr, NULL, 16);
+	}
+	return len / 2;
+}
+
+/*
+ * Description:
+ *     parse LBA range string, eg. "100-200" => [100, 200],
+ *     "100" => [100, 100], "100-" => [100, UINT64_MAX]
+ */
+void parse_range(const char *rangeStr, uint64_t *start, uint64_t *end)
+{
+	char *p;
+	*start = strtoull(rangeStr, &p, 10);
+	if (p == rangeStr) {
+		fprintf(stderr, "Range %s illegal\n", rangeStr);
+		exit(1);
+	}
+	if (*p == '\0') {
+		*end = *start;
+	} else if (*p == '-' && *(p + 1) == '\0') {
+		*end = UINT64_MAX;
+	} else if (*p == '-') {
+		*end = strtoull(p + 1, &p, 10);
+		if (*p != '\0' || *end < *start) {
+			fprintf(stderr, "Range %s illegal\n", rangeStr);
+			exit(1);
+		}
+	} else {
+		fprintf(stderr, "Range %s illegal\n", rangeStr);
+		exit(1);
+	}
+}
+
+/*
+ * Description:
+ *     covert ascii hex number to string
+ *
+ * Params:
+ *     - hex: length shorter than 64 bit
+ *     - str: char array, length should be char nums + 1
+ *     ('\0' need to be append to this array)
+ *     - len_bytes: sizeof(str), number of bytes in str including '\0'
+ *
+ * Notice:
+ *     - cannot sizeof(str) in this function to get len_bytes,
+ *     because sizeof() return len of ptr, not len of arr
+ *     - some special byte may cause result str cannot be print by %s.
+ *     eg.0x00 corresponding to char '\0'
+ *     - visual char range: 0x20 - 0x7e
+ *     - the index of last byte in str is actually len_bytes-1
+ */
+void hex2str(uint64_t hex, char *str, int len_bytes)
+{
+	uint8_t mask = 0xff;
+	for (int i = 0; i < (len_bytes - 1); i++) {
+		uint8_t code = (hex >> (i * 8)) & mask;
+		if (code >= 0x20 && code <= 0x7e) {
+			str[i] = toascii(code);
+		} else {
+			/* replace invisual char with '.' */
+			str[i] = '.';
+		}
+	}
+	str[len_bytes - 1] = '\0';
+}
+
+/*
+ * Description:
+ *     Authority-defined algorithm to get CHS from size
+ */
+struct disk_geometry *cal_CHS(uint32_t totalSectors)
+{
+	uint32_t cylinderTimesHeads;
+	uint16_t cylinders;
+	uint8_t heads, sectorsPerTrack;
+
+	if (totalSectors > 65535 * 16 * 255) {
+		totalSectors =
+			65535 * 16 *
+			255; /* disk max size = 2^28 * 512 Byte = 128 GB */
+	}
+
+	if (totalSectors >= 65535 * 16 * 63) { /* when disk size >= 32 GB */
+		sectorsPerTrack = 255;
+		heads = 16;
+		cylinderTimesHeads = totalSectors / sectorsPerTrack;
+	} else {
+		sectorsPerTrack = 17;
+		cylinderTimesHeads = totalSectors / sectorsPerTrack;
+
+		heads = (cylinderTimesHeads + 1023) / 1024;
+
+		if (heads < 4) {
+			heads = 4;
 		}
 
 		if (cylinderTimesHeads >= (heads * 1024) || heads > 16) {
@@ -539,27 +2977,86 @@ struct disk_geometry *cal_CHS(uint32_t totalSectors)
  *     Athority-defined algorithm to get checksum field
  */
 void fillin_checksum(struct footer *footer)
+{
+	footer->checksum = 0;
+	footer->checksum = bswap_32(~cal_checksum(footer, footer_size, 0));
+}
+
+static uint32_t crc32_table[256], crc32c_table[256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void fillin_crc_table(uint32_t *table, uint32_t poly)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ (poly & -(crc & 1));
+		}
+		table[i] = crc;
+	}
+}
+
+static void init_crc32_table(void)
+{
+	fillin_crc_table(crc32_table, 0xedb88320U);
+	fillin_crc_table(crc32c_table, 0x82f63b78U);
+}
+
+static uint32_t cal_crc(const uint32_t *table, uint32_t crc,
+			const void *buffer, size_t len)
+{
+	pthread_once(&crc32_once, init_crc32_table);
+	const uint8_t *p = buffer;
+	crc = ~crc;
+	for (size_t i = 0; i < len; i++) {
+		crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+/*
+ * Description:
+ *     crc32 (IEEE 802.3), pass 0 as crc for the first buffer
+ */
+uint32_t cal_crc32(uint32_t crc, const void *buffer, size_t len)
+{
+	return cal_crc(crc32_table, crc, buffer, len);
+}
+
+/*
+ * Description:
+ *     crc32c (Castagnoli) used by VHDX, pass 0 as crc for the first buffer
+ */
+uint32_t cal_crc32c(uint32_t crc, const void *buffer, size_t len)
+{
+	return cal_crc(crc32c_table, crc, buffer, len);
+}
+
+/*
+ * Description:
+ *     one's complement sum of bytes, excluding the stored checksum field
+ *     (old), which is added into the sum when the buffer is read from disk
+ */
+static uint32_t cal_checksum(const void *buffer, size_t len, uint32_t old)
 {
 	uint32_t checksum = 0;
 
-	uint8_t *p = (uint8_t *)footer;
-	footer->checksum = 0;
-	for (uint16_t counter = 0; counter < footer_size; counter++) {
-		checksum += *p;
-		p++;
+	const uint8_t *p = buffer;
+	for (size_t counter = 0; counter < len; counter++) {
+		checksum += p[counter];
 	}
-	footer->checksum = bswap_32(~checksum);
+	const uint8_t *o = (const uint8_t *)&old;
+	checksum -= o[0] + o[1] + o[2] + o[3];
+	return checksum;
 }
 
 /*
  * Description:
- *     seperate major version and minor version
+ *     seperate major version and minor version into versions
  */
-uint16_t *get_version(uint32_t version_le)
+void get_version(uint32_t version_le, uint16_t versions[2])
 {
-	static uint16_t versions[2];
 	uint32_t version_be = bswap_32(version_le);
 	versions[0] = version_be >> 16; /* major version */
 	versions[1] = version_be & 0x0000ffff; /* minor version */
-	return versions;
 }
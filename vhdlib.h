@@ -5,8 +5,10 @@
 #ifndef _VHDLIB_H
 #define _VHDLIB_H 1
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 #define DEFAULT_COOKIE 0x78697463656e6f63UL /* conectix */
 
@@ -37,11 +39,45 @@
 #define SAVED_STATE_YES 0x01U
 #define SAVED_STATE_NO 0x00U
 
+#define DYNAMIC_HEADER_COOKIE 0x6573726170737863UL /* cxsparse */
+#define DYNAMIC_HEADER_VERSION 0x00000100U /* version 1.0 */
+#define BAT_ENTRY_UNUSED 0xffffffffU
+
+/*
+ * VHDX, all fields in little-endian byte order
+ */
+#define VHDX_FILE_SIGNATURE 0x656c696678646876UL /* vhdxfile */
+#define VHDX_HEADER_SIGNATURE 0x64616568U /* head */
+#define VHDX_REGION_SIGNATURE 0x69676572U /* regi */
+#define VHDX_METADATA_SIGNATURE 0x617461646174656dUL /* metadata */
+
+#define VHDX_HEADER_1_OFFSET 0x10000U /* 64 KB */
+#define VHDX_HEADER_2_OFFSET 0x20000U /* 128 KB */
+#define VHDX_REGION_TABLE_OFFSET 0x30000U /* 192 KB */
+#define VHDX_HEADER_BYTES 0x1000U /* 4 KB */
+#define VHDX_REGION_TABLE_BYTES 0x10000U /* 64 KB */
+
+#define VHDX_PAYLOAD_BLOCK_NOT_PRESENT 0
+#define VHDX_PAYLOAD_BLOCK_UNDEFINED 1
+#define VHDX_PAYLOAD_BLOCK_ZERO 2
+#define VHDX_PAYLOAD_BLOCK_UNMAPPED 3
+#define VHDX_PAYLOAD_BLOCK_FULLY_PRESENT 6
+#define VHDX_PAYLOAD_BLOCK_PARTIALLY_PRESENT 7
+#define VHDX_BAT_STATE_MASK 0x7UL
+#define VHDX_BAT_OFFSET_MASK 0xfffffffffff00000UL /* 1 MB units */
+
+#define VHDX_FILE_PARAMETERS_LEAVE_BLOCKS_ALLOCATED 0x1U
+#define VHDX_FILE_PARAMETERS_HAS_PARENT 0x2U
+
+#define DISK_FORMAT_VHD 0
+#define DISK_FORMAT_VHDX 1
+
 /*
  * Config
  */
 #define VHD_MAX_BYTES 0xffffffffU /* 4 GB */
 #define VHD_MIN_BYTES 0x00008800U /* 34 KB */
+#define VHD_FORMAT_MAX_BYTES 0x1fe00000000UL /* 2040 GB, VHD format limit */
 #define SECONDS_OFFSET \
 	946699200 /* 1970.01.01 00:00:00 - 2000.01.01 12:00:00 946699200s */
 
@@ -84,6 +120,196 @@ struct footer {
 	uint8_t saved_state;
 } __attribute__((packed));
 
+/*
+ * VHDX bits structs
+ */
+struct vhdx_header {
+	uint32_t signature;
+	uint32_t checksum; /* crc32c of the 4 KB header */
+	uint64_t sequence_number; /* the greater valid header is current */
+	struct uuid file_write_guid;
+	struct uuid data_write_guid;
+	struct uuid log_guid; /* not zero if log needs replay */
+	uint16_t log_version;
+	uint16_t version;
+	uint32_t log_length;
+	uint64_t log_offset;
+} __attribute__((packed));
+
+struct vhdx_region_table_header {
+	uint32_t signature;
+	uint32_t checksum; /* crc32c of the 64 KB region table */
+	uint32_t entry_count;
+	uint32_t reserved;
+} __attribute__((packed));
+
+struct vhdx_region_entry {
+	struct uuid guid;
+	uint64_t file_offset;
+	uint32_t length;
+	uint32_t required;
+} __attribute__((packed));
+
+struct vhdx_metadata_header {
+	uint64_t signature;
+	uint16_t reserved;
+	uint16_t entry_count;
+	uint32_t reserved2[5];
+} __attribute__((packed));
+
+struct vhdx_metadata_entry {
+	struct uuid item_id;
+	uint32_t offset; /* relative to metadata region */
+	uint32_t length;
+	uint32_t flags;
+	uint32_t reserved;
+} __attribute__((packed));
+
+/*
+ * Dynamic disk header bits struct
+ * located at footer->data_offset of dynamic and differencing disks,
+ * 1024 Bytes in total. A copy of footer is kept at the beginning of file.
+ */
+struct parent_locator {
+	uint32_t platform_code;
+	uint32_t platform_data_space;
+	uint32_t platform_data_length;
+	uint32_t reserved;
+	uint64_t platform_data_offset;
+} __attribute__((packed));
+
+struct dynamic_header {
+	uint64_t cookie;
+	uint64_t data_offset;
+	uint64_t table_offset;
+	uint32_t header_version;
+	uint32_t max_table_entries;
+	uint32_t block_size;
+	uint32_t checksum;
+	struct uuid parent_uuid;
+	uint32_t parent_time_stamp;
+	uint32_t reserved;
+	uint16_t parent_unicode_name[256];
+	struct parent_locator parent_locators[8];
+	uint8_t reserved2[256];
+} __attribute__((packed));
+
+/*
+ * Signature search
+ */
+struct search_pattern {
+	const uint8_t *bytes;
+	size_t len;
+};
+
+struct search_hit {
+	uint64_t LBA;
+	uint16_t offset; /* byte offset inside LBA */
+	uint16_t pattern; /* index of matched pattern */
+};
+
+/*
+ * Allocation map, cached in sidecar file [vhdfile].map
+ */
+#define DISK_MAP_COOKIE 0x0070616d64687600UL /* \0vhdmap\0 */
+#define DISK_MAP_VERSION 0x00000001U
+
+struct extent {
+	uint32_t startLBA;
+	uint32_t count; /* number of LBAs */
+	uint32_t zero; /* 1 if all bytes are zero */
+};
+
+struct disk_map {
+	uint64_t cookie;
+	uint32_t version;
+	uint32_t count; /* number of extents */
+	struct uuid uuid;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t size;
+	struct extent *extents; /* not stored in sidecar header */
+};
+
+/*
+ * Write journal, batched writes are logged in [vhdfile].wal with one
+ * fsync, then applied to vhdfile. The log is replayed on next open.
+ */
+#define JOURNAL_COOKIE 0x006c6e726a646876UL /* vhdjrnl\0 */
+#define JOURNAL_VERSION 0x00000001U
+
+struct journal_header {
+	uint64_t cookie;
+	uint32_t version;
+	uint32_t count; /* number of records */
+	uint64_t bytes; /* bytes of records, including record headers */
+	uint32_t checksum; /* crc32 of journal header and records */
+	uint32_t reserved;
+} __attribute__((packed));
+
+struct journal_record {
+	uint64_t offset; /* byte offset in vhdfile */
+	uint32_t len; /* bytes of data following record header */
+	uint32_t reserved;
+} __attribute__((packed));
+
+struct journal {
+	int fd; /* vhdfile */
+	int log_fd;
+	uint64_t data_bytes; /* writes must stay in [0, data_bytes) */
+	uint8_t *buffer; /* journal header + records of pending batch */
+	uint64_t len;
+	uint64_t cap;
+	char *logpath;
+	pthread_mutex_t lock; /* one journal may be shared by threads */
+};
+
+/*
+ * Disk handle, safe to share between threads.
+ * I/O goes through pread/pwrite, so there is no shared file position.
+ * Overlapping sector ranges are serialized by range locks (shared for
+ * reads), each dynamic block has its own lock for bitmap and BAT updates.
+ */
+struct range_lock {
+	uint64_t start; /* first LBA */
+	uint64_t end; /* last LBA + 1 */
+	int write;
+	struct range_lock *next;
+};
+
+struct vhd_handle {
+	int fd;
+	int writable;
+	int format; /* DISK_FORMAT_VHD or DISK_FORMAT_VHDX */
+	struct footer footer; /* VHD only */
+	uint32_t disk_type;
+	uint32_t sector_size; /* bytes of one LBA, 512 or 4096 */
+	uint64_t sectors; /* number of LBAs of virtual disk */
+
+	pthread_mutex_t range_mutex;
+	pthread_cond_t range_cond;
+	struct range_lock *ranges; /* held range locks */
+
+	/* dynamic disk only */
+	struct dynamic_header header;
+	uint64_t table_offset;
+	uint32_t max_table_entries;
+	uint32_t block_size;
+	uint32_t bitmap_bytes; /* sector bitmap of a block, 512 aligned */
+	uint32_t *bat; /* host byte order, accessed atomically */
+	pthread_mutex_t *block_locks; /* one per BAT entry */
+	pthread_mutex_t alloc_mutex; /* serializes growth of file end */
+	uint64_t data_end; /* current footer position */
+
+	/* VHDX only, read-only */
+	struct vhdx_header vhdx_header; /* current header */
+	uint32_t physical_sector_size;
+	uint32_t file_parameters_flags;
+	uint32_t chunk_ratio; /* payload blocks per sector bitmap block */
+	uint32_t vhdx_bat_entries;
+	uint64_t *vhdx_bat;
+};
+
 /*
  * Global variables
  */
@@ -93,18 +319,57 @@ extern const size_t footer_size;
  * Function declarations
  */
 extern void create_fixed_disk(const char *filepath, uint32_t len_bytes);
-extern void print_fixed_disk_by_LBA(const char *vhdfile, uint32_t LBA);
+extern void print_fixed_disk_by_LBA(const char *vhdfile, uint64_t LBA);
 extern void write_fixed_disk_by_LBA(const char *binfile, const char *vhdfile,
-				    uint32_t LBA);
+				    uint64_t LBA);
+extern void write_disk_by_LBA(const char *binfile, const char *vhdfile,
+			      uint64_t LBA);
 extern struct footer *read_footer(const char *filepath);
 extern void print_footer(const struct footer *footer);
+extern int check_disk(const char *vhdfile, int repair, FILE *report);
+extern int check_disks(char *const vhdfiles[], int count, int repair);
+extern struct search_hit *search_disk(const char *vhdfile,
+				      const struct search_pattern *patterns,
+				      int npatterns, uint64_t startLBA,
+				      uint64_t endLBA, size_t *nhits);
 
 extern int get_filesize(const char *filepath);
 
 extern struct disk_geometry *cal_CHS(uint32_t totalSectors);
 extern void fillin_checksum(struct footer *footer);
+extern uint32_t cal_crc32(uint32_t crc, const void *buffer, size_t len);
+extern uint32_t cal_crc32c(uint32_t crc, const void *buffer, size_t len);
 extern void hex2str(uint64_t hex, char *str, int len_bytes);
-extern uint16_t *get_version(uint32_t version_le);
+extern void get_version(uint32_t version_le, uint16_t versions[2]);
 extern uint32_t parse_size(const char *sizeStr);
+extern struct disk_map *map_disk(const char *vhdfile);
+extern void free_disk_map(struct disk_map *map);
+extern struct journal *journal_open(const char *vhdfile);
+extern void journal_write(struct journal *journal, uint32_t LBA,
+			  const void *buffer, uint32_t len);
+extern void journal_write_bin(struct journal *journal, const char *binfile,
+			      uint32_t LBA);
+extern void journal_commit(struct journal *journal);
+extern void journal_close(struct journal *journal);
+extern int journal_replay(const char *vhdfile);
+extern struct vhd_handle *vhd_open(const char *vhdfile, int writable);
+extern void vhd_close(struct vhd_handle *handle);
+extern int is_vhdx(const char *filepath);
+extern void print_vhdx_info(const struct vhd_handle *handle);
+extern void convert_to_fixed_disk(const char *srcfile, const char *vhdfile);
+extern int clone_disk(const char *srcfile, const char *vhdfile);
+extern struct range_lock *vhd_lock_range(struct vhd_handle *handle,
+					 uint64_t LBA, uint64_t count,
+					 int write);
+extern void vhd_unlock_range(struct vhd_handle *handle,
+			     struct range_lock *lock);
+extern void vhd_read_sectors(struct vhd_handle *handle, uint64_t LBA,
+			     uint64_t count, void *buffer);
+extern void vhd_write_sectors(struct vhd_handle *handle, uint64_t LBA,
+			      uint64_t count, const void *buffer);
+extern void vhd_trim_sectors(struct vhd_handle *handle, uint64_t LBA,
+			     uint64_t count);
+extern size_t parse_hex(const char *hexStr, uint8_t *bytes);
+extern void parse_range(const char *rangeStr, uint64_t *start, uint64_t *end);
 
 #endif /* _VHDLIB_H */